@@ -41,6 +41,10 @@ standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
     EState     *estate;
     MemoryContext oldcontext;
+    /* >>> local addition, not in PostgreSQL (see README) 本仓库新增,非PostgreSQL原有代码 */
+    MemoryContext startupcxt;
+    int         budget;
+    /* <<< end of local addition 本仓库新增结束 */
 
     /* sanity checks: queryDesc must not be started already */
     Assert(queryDesc != NULL);
@@ -81,7 +85,28 @@ standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
     estate = CreateExecutorState();
     queryDesc->estate = estate;
 
-    oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+    /* >>> local addition, not in PostgreSQL (see README) 本仓库新增,非PostgreSQL原有代码 */
+    ExecHwCountersSetup(estate);
+    ExecHwCountersBegin(estate);
+
+    /*
+     * Startup makes a great many small allocations (plan state nodes, slots,
+     * ResultRelInfos, rowmarks ...) that all live until ExecutorEnd.  For
+     * larger plans, carve them out of a context whose first block is sized
+     * from the plan, rather than growing es_query_cxt block by block.
+     * 启动阶段的大量小内存分配都存活到ExecutorEnd.对于较大的计划,
+     * 从一个按计划大小预估首块的上下文中分配,而不是逐块扩展es_query_cxt.
+     * The size estimate comes from the plan's template, which is kept
+     * across executions only for plans saved in the plan cache.
+     * 预估大小来自计划模板,仅对计划缓存中保存的计划跨执行保留.
+     */
+    estate->es_plan_template = ExecGetPlanTemplate(estate, queryDesc->plannedstmt);
+    startupcxt = ExecCreateStartupContext(estate,
+                                          estate->es_plan_template->startup_space);
+
+    /* PostgreSQL: oldcontext = MemoryContextSwitchTo(estate->es_query_cxt); */
+    oldcontext = MemoryContextSwitchTo(startupcxt);
+    /* <<< end of local addition 本仓库新增结束 */
 
     /*
      * Fill in external parameters, if any, from queryDesc; and allocate
@@ -157,6 +182,21 @@ standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
     estate->es_top_eflags = eflags;
     estate->es_instrument = queryDesc->instrument_options;
     estate->es_jit_flags = queryDesc->plannedstmt->jitFlags;
+    /* >>> local addition, not in PostgreSQL (see README) 本仓库新增,非PostgreSQL原有代码 */
+    if (enable_adaptive_jit &&
+        estate->es_plan_template->jit_flags != estate->es_jit_flags)
+    {
+        /*
+         * The plan's JIT flags were stepped down; every so often, run with
+         * the planner's choice again.  See ExecRecordPlanRuntime.
+         * 计划的JIT标志已被降级;每隔一段时间,重新按规划器的选择执行一次.
+         */
+        if (++estate->es_plan_template->jit_skipped < ADAPTIVE_JIT_REPROBE)
+            estate->es_jit_flags = estate->es_plan_template->jit_flags;
+        else
+            estate->es_plan_template->jit_skipped = 0;
+    }
+    /* <<< end of local addition 本仓库新增结束 */
 
     /*
      * Set up an AFTER-trigger statement context, unless told not to, or
@@ -170,7 +210,22 @@ standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
      * Initialize the plan state tree
      * 初始化计划状态树
      */
+    /* >>> local addition, not in PostgreSQL (see README) 本仓库新增,非PostgreSQL原有代码 */
+    budget = ExecBeginMemoryBudget(estate);
+    /* <<< end of local addition 本仓库新增结束 */
     InitPlan(queryDesc, eflags);
+    /* >>> local addition, not in PostgreSQL (see README) 本仓库新增,非PostgreSQL原有代码 */
+    ExecEndMemoryBudget(budget);
+
+    ExecHwCountersEnd(estate, EXEC_HW_PHASE_START);
+    ExecNoteMemoryUsage(estate);
+
+    /*
+     * Start a workload capture record, if executor_capture_file is set.
+     * 如设置了executor_capture_file,开始一条负载捕获记录.
+     */
+    ExecCaptureStart(queryDesc, eflags);
+    /* <<< end of local addition 本仓库新增结束 */
 
     MemoryContextSwitchTo(oldcontext);
 }
\ No newline at end of file
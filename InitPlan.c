@@ -285,6 +285,17 @@ InitPlan(QueryDesc *queryDesc, int eflags)
             tupType = j->jf_cleanTupType;
         }
     }
+
+    /* >>> local addition, not in PostgreSQL (see README) 本仓库新增,非PostgreSQL原有代码 */
+    /*
+     * Set up the sampling profiler, if wanted.
+     * 如需要,设置采样分析器.
+     */
+    if (executor_sample_interval > 0 && !estate->es_instrument &&
+        !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+        ExecSampleInit(estate, planstate);
+    /* <<< end of local addition 本仓库新增结束 */
+
     //赋值
     queryDesc->tupDesc = tupType;
     queryDesc->planstate = planstate;
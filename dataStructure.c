@@ -69,6 +69,7 @@ typedef struct EState
                                                   * Array of per-range-table-entry
                                                   * ExecRowMarks, or NULL if none */
     PlannedStmt *es_plannedstmt;                 /* 计划树的最顶层PlannedStmt;link to top of plan tree */
+    struct ExecPlanTemplate *es_plan_template;   /* 计划派生信息的缓存;cached plan-derived info */
     const char *es_sourceText;                   /* QueryDesc中的源文本;Source text from QueryDesc */
 
     JunkFilter *es_junkFilter; /* 最顶层的JunkFilter;top-level junk filter, if any */
@@ -181,4 +182,10 @@ typedef struct EState
     int es_jit_flags;
     struct JitContext *es_jit;
     struct JitInstrumentation *es_jit_worker_instr;
+
+    instr_time es_run_time; /* ExecutorRun耗时(需要时才计时);time spent in ExecutorRun, if timed */
+    struct ExecSampleState *es_sample; /* 采样分析器状态;sampling profiler state, if any */
+    struct ExecHwCounters *es_hwcounters; /* 各阶段硬件计数器;per-phase hardware counters, if any */
+    Size es_mem_phase_max; /* 各阶段结束时es_query_cxt的最大内存(跟踪时);largest es_query_cxt size at a phase end, if tracked */
+    StringInfo es_capture; /* 待写出的捕获记录;workload capture record, if capturing */
 } EState;
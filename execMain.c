@@ -37,8 +37,23 @@
  */
 #include "postgres.h"
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 #include "access/heapam.h"
 #include "access/htup_details.h"
+#include "access/parallel.h"
 #include "access/sysattr.h"
 #include "access/tableam.h"
 #include "access/transam.h"
@@ -53,11 +68,17 @@
 #include "jit/jit.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/params.h"
 #include "parser/parsetree.h"
 #include "storage/bufmgr.h"
+#include "storage/fd.h"
 #include "storage/lmgr.h"
 #include "tcop/utility.h"
 #include "utils/acl.h"
+#include "utils/fmgrprotos.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/partcache.h"
@@ -74,10 +95,84 @@ ExecutorEnd_hook_type ExecutorEnd_hook = NULL;
 /* Hook for plugin to get control in ExecCheckRTPerms() */
 ExecutorCheckPerms_hook_type ExecutorCheckPerms_hook = NULL;
 
+/*
+ * GUC parameters.  Their guc.c entries live outside this file; each is
+ * initialized to its boot value here, with the context it is defined with.
+ * Settings that write to the server log or to server files are PGC_SUSET.
+ */
+bool enable_adaptive_jit = false;       /* PGC_USERSET */
+int executor_sample_interval = 0;       /* PGC_SUSET, ms; 0 disables */
+bool enable_tsc_timing = false;         /* PGC_SUSET; totaltime clock */
+bool executor_hwcounters = false;       /* PGC_SUSET */
+bool log_executor_memory = false;       /* PGC_SUSET */
+int query_work_mem = -1;                /* PGC_USERSET, kB; -1 disables */
+int adaptive_parallel_threshold = 0;    /* PGC_USERSET, ms; 0 disables */
+char *executor_capture_file = NULL;     /* PGC_SUSET; empty disables */
+
+/*
+ * Rough amount of memory executor startup allocates per plan node (the
+ * PlanState itself, its slots and ExprContext) and per targetlist or qual
+ * entry (expression state steps), and the largest first block we are
+ * willing to make for the startup context.
+ */
+#define EXEC_STARTUP_BYTES_PER_NODE 1024
+#define EXEC_STARTUP_BYTES_PER_EXPR 128
+#define EXEC_STARTUP_MAX_BLOCKSIZE (1024 * 1024)
+
+/*
+ * Adaptive JIT: losing runs in a row before a plan's JIT flags are stepped
+ * down, and how often a stepped-down plan retries the planner's flags.
+ * See ExecRecordPlanRuntime.
+ */
+#define ADAPTIVE_JIT_LOSSES 3
+#define ADAPTIVE_JIT_REPROBE 32
+
+/*
+ * Depth of ExecutorRun/ExecutorFinish calls; nonzero while a query started
+ * from inside another one (by a function, trigger or SPI) is set up.  See
+ * ExecCaptureStart and ExecSampleInit.
+ */
+static int ExecNestLevel = 0;
+
+/* cached plan-derived information; see ExecGetPlanTemplate */
+typedef struct ExecPlanTemplate ExecPlanTemplate;
+
 /* decls for local routines only used within this module */
 /* decls 只在这个模块中使用的本地例程*/
+static ExecPlanTemplate *ExecGetPlanTemplate(EState *estate,
+                                             PlannedStmt *plannedstmt);
+static void ExecForgetPlanTemplate(void *arg);
+static void ExecRecordPlanRuntime(EState *estate);
+static MemoryContext ExecCreateStartupContext(EState *estate, Size space);
+static Size ExecEstimateStartupSpace(PlannedStmt *plannedstmt);
+static List *ExecPlanChildren(Plan *plan);
+static Size ExecEstimatePlanSpace(Plan *plan);
+static int ExecCountMemoryNodes(Plan *plan, int weight);
+static bool ExecPreferSerial(ExecPlanTemplate *tmpl);
+static void ExecRecordParallelRuntime(ExecPlanTemplate *tmpl, bool parallel,
+                                      double run_time);
+static int ExecBeginMemoryBudget(EState *estate);
+static void ExecEndMemoryBudget(int nestlevel);
 static void InitPlan(QueryDesc *queryDesc, int eflags);
 static void CheckValidRowMarkRel(Relation rel, RowMarkType markType);
+static void ExecCaptureStart(QueryDesc *queryDesc, int eflags);
+static void ExecCaptureRun(EState *estate, ScanDirection direction,
+                           uint64 count, bool execute_once);
+static void ExecCaptureEnd(EState *estate);
+static void ExecNoteMemoryUsage(EState *estate);
+static void ExecReportMemoryUsage(EState *estate);
+typedef struct ExecHwCounters ExecHwCounters;
+static void ExecHwCountersSetup(EState *estate);
+static void ExecHwCountersBegin(EState *estate);
+static void ExecHwCountersEnd(EState *estate, int phase);
+static void ExecHwCountersReport(EState *estate);
+static uint64 ExecTotaltimeStart(Instrumentation *instr);
+static void ExecTotaltimeStop(Instrumentation *instr, uint64 startcycles,
+                              double nTuples);
+static void ExecSampleInit(EState *estate, PlanState *planstate);
+static bool ExecSampleArm(EState *estate);
+static void ExecSampleDisarm(void);
+static void ExecSampleReport(EState *estate);
 static void ExecPostprocessPlan(EState *estate);
 static void ExecEndPlan(PlanState *planstate, EState *estate);
 static void ExecutePlan(EState *estate, PlanState *planstate,
@@ -141,7 +236,9 @@ void ExecutorStart(QueryDesc *queryDesc, int eflags)
 void standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
     EState *estate;
+    MemoryContext startupcxt;
     MemoryContext oldcontext;
+    int budget;
 
     /* sanity checks: queryDesc must not be started already */
     /*完整性检查：queryDesc 不能已经启动*/
@@ -175,7 +272,24 @@ void standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
     estate = CreateExecutorState();
     queryDesc->estate = estate;
 
-    oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+    ExecHwCountersSetup(estate);
+    ExecHwCountersBegin(estate);
+
+    /*
+     * Startup makes a great many small allocations (plan state nodes, slots,
+     * ResultRelInfos, rowmarks ...) that all live until ExecutorEnd.  For
+     * larger plans, carve them out of a context whose first block is sized
+     * from the plan, rather than growing es_query_cxt block by block.
+     */
+    /*
+     * 启动阶段的大量小内存分配都存活到 ExecutorEnd. 对于较大的计划,
+     * 从一个按计划大小预估首块的上下文中分配, 而不是逐块扩展 es_query_cxt.
+     */
+    estate->es_plan_template = ExecGetPlanTemplate(estate, queryDesc->plannedstmt);
+    startupcxt = ExecCreateStartupContext(estate,
+                                          estate->es_plan_template->startup_space);
+
+    oldcontext = MemoryContextSwitchTo(startupcxt);
 
     /*
      * Fill in external parameters, if any, from queryDesc; and allocate
@@ -266,6 +380,21 @@ void standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
     estate->es_top_eflags = eflags;
     estate->es_instrument = queryDesc->instrument_options;
     estate->es_jit_flags = queryDesc->plannedstmt->jitFlags;
+    if (enable_adaptive_jit &&
+        estate->es_plan_template->jit_flags != estate->es_jit_flags)
+    {
+        /*
+         * The plan's JIT flags were stepped down; every so often, run with
+         * the planner's choice again.  See ExecRecordPlanRuntime.
+         */
+        /*
+         * 计划的JIT标志已被降级; 每隔一段时间, 重新按规划器的选择执行一次.
+         */
+        if (++estate->es_plan_template->jit_skipped < ADAPTIVE_JIT_REPROBE)
+            estate->es_jit_flags = estate->es_plan_template->jit_flags;
+        else
+            estate->es_plan_template->jit_skipped = 0;
+    }
 
     /*
      * Set up an AFTER-trigger statement context, unless told not to, or
@@ -285,7 +414,14 @@ void standard_ExecutorStart(QueryDesc *queryDesc, int eflags)
     /*
      * 初始化计划状态树
      */
+    budget = ExecBeginMemoryBudget(estate);
     InitPlan(queryDesc, eflags);
+    ExecEndMemoryBudget(budget);
+
+    ExecHwCountersEnd(estate, EXEC_HW_PHASE_START);
+    ExecNoteMemoryUsage(estate);
+
+    ExecCaptureStart(queryDesc, eflags);
 
     MemoryContextSwitchTo(oldcontext);
 }
@@ -337,6 +473,7 @@ void standard_ExecutorRun(QueryDesc *queryDesc,
     DestReceiver *dest;
     bool sendTuples;
     MemoryContext oldcontext;
+    uint64 startcycles = 0;
 
     /* sanity checks */
     Assert(queryDesc != NULL);
@@ -353,7 +490,9 @@ void standard_ExecutorRun(QueryDesc *queryDesc,
 
     /* Allow instrumentation of Executor overall runtime */
     if (queryDesc->totaltime)
-        InstrStartNode(queryDesc->totaltime);
+        startcycles = ExecTotaltimeStart(queryDesc->totaltime);
+
+    ExecHwCountersBegin(estate);
 
     /*
      * extract information from the query descriptor and the query feature.
@@ -377,19 +516,73 @@ void standard_ExecutorRun(QueryDesc *queryDesc,
      */
     if (!ScanDirectionIsNoMovement(direction))
     {
+        instr_time starttime;
+        instr_time endtime;
+        bool sampling;
+        int budget;
+        bool use_parallel_mode;
+        bool learn_parallel;
+        bool learn_jit;
+
         if (execute_once && queryDesc->already_executed)
             elog(ERROR, "can't re-execute query flagged for single execution");
         queryDesc->already_executed = true;
 
-        ExecutePlan(estate,
-                    queryDesc->planstate,
-                    queryDesc->plannedstmt->parallelModeNeeded,
-                    operation,
-                    sendTuples,
-                    count,
-                    direction,
-                    dest,
-                    execute_once);
+        /*
+         * Pick parallel mode or not from past runs of the plan; only a
+         * single-call run covers the whole execution, so only those are
+         * learned from.  See ExecPreferSerial.
+         */
+        use_parallel_mode = queryDesc->plannedstmt->parallelModeNeeded &&
+                            !ExecPreferSerial(estate->es_plan_template);
+        learn_parallel = queryDesc->plannedstmt->parallelModeNeeded &&
+                         execute_once && adaptive_parallel_threshold > 0;
+        learn_jit = (queryDesc->plannedstmt->jitFlags & PGJIT_PERFORM) &&
+                    execute_once && enable_adaptive_jit;
+
+        /* time the run if ExecRecordPlanRuntime will want to know */
+        if (learn_jit || learn_parallel)
+            INSTR_TIME_SET_CURRENT(starttime);
+
+        sampling = ExecSampleArm(estate);
+        budget = ExecBeginMemoryBudget(estate);
+
+        ExecNestLevel++;
+        PG_TRY();
+        {
+            ExecutePlan(estate,
+                        queryDesc->planstate,
+                        use_parallel_mode,
+                        operation,
+                        sendTuples,
+                        count,
+                        direction,
+                        dest,
+                        execute_once);
+        }
+        PG_FINALLY();
+        {
+            ExecNestLevel--;
+        }
+        PG_END_TRY();
+
+        ExecEndMemoryBudget(budget);
+        if (sampling)
+            ExecSampleDisarm();
+
+        if (learn_jit || learn_parallel)
+        {
+            INSTR_TIME_SET_CURRENT(endtime);
+            INSTR_TIME_SUBTRACT(endtime, starttime);
+            INSTR_TIME_ADD(estate->es_run_time, endtime);
+
+            if (learn_parallel && estate->es_plan_template != NULL)
+                ExecRecordParallelRuntime(estate->es_plan_template,
+                                          estate->es_use_parallel_mode,
+                                          INSTR_TIME_GET_DOUBLE(endtime));
+            if (learn_jit)
+                ExecRecordPlanRuntime(estate);
+        }
     }
 
     /*
@@ -398,8 +591,14 @@ void standard_ExecutorRun(QueryDesc *queryDesc,
     if (sendTuples)
         dest->rShutdown(dest);
 
+    ExecCaptureRun(estate, direction, count, execute_once);
+
+    ExecHwCountersEnd(estate, EXEC_HW_PHASE_RUN);
+    ExecNoteMemoryUsage(estate);
+
     if (queryDesc->totaltime)
-        InstrStopNode(queryDesc->totaltime, estate->es_processed);
+        ExecTotaltimeStop(queryDesc->totaltime, startcycles,
+                          estate->es_processed);
 
     MemoryContextSwitchTo(oldcontext);
 }
@@ -430,6 +629,9 @@ void standard_ExecutorFinish(QueryDesc *queryDesc)
 {
     EState *estate;
     MemoryContext oldcontext;
+    bool sampling;
+    int budget;
+    uint64 startcycles = 0;
 
     /* sanity checks */
     Assert(queryDesc != NULL);
@@ -447,17 +649,38 @@ void standard_ExecutorFinish(QueryDesc *queryDesc)
 
     /* Allow instrumentation of Executor overall runtime */
     if (queryDesc->totaltime)
-        InstrStartNode(queryDesc->totaltime);
+        startcycles = ExecTotaltimeStart(queryDesc->totaltime);
+
+    ExecHwCountersBegin(estate);
+
+    sampling = ExecSampleArm(estate);
+    budget = ExecBeginMemoryBudget(estate);
+
+    ExecNestLevel++;
+    PG_TRY();
+    {
+        /* Run ModifyTable nodes to completion */
+        ExecPostprocessPlan(estate);
 
-    /* Run ModifyTable nodes to completion */
-    ExecPostprocessPlan(estate);
+        ExecEndMemoryBudget(budget);
+        if (sampling)
+            ExecSampleDisarm();
 
-    /* Execute queued AFTER triggers, unless told not to */
-    if (!(estate->es_top_eflags & EXEC_FLAG_SKIP_TRIGGERS))
-        AfterTriggerEndQuery(estate);
+        /* Execute queued AFTER triggers, unless told not to */
+        if (!(estate->es_top_eflags & EXEC_FLAG_SKIP_TRIGGERS))
+            AfterTriggerEndQuery(estate);
+    }
+    PG_FINALLY();
+    {
+        ExecNestLevel--;
+    }
+    PG_END_TRY();
+
+    ExecHwCountersEnd(estate, EXEC_HW_PHASE_FINISH);
+    ExecNoteMemoryUsage(estate);
 
     if (queryDesc->totaltime)
-        InstrStopNode(queryDesc->totaltime, 0);
+        ExecTotaltimeStop(queryDesc->totaltime, startcycles, 0);
 
     MemoryContextSwitchTo(oldcontext);
 
@@ -509,8 +732,20 @@ void standard_ExecutorEnd(QueryDesc *queryDesc)
      */
     oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
 
+    /* node contexts are still around to be looked at */
+    if (log_executor_memory)
+        ExecReportMemoryUsage(estate);
+
     ExecEndPlan(queryDesc->planstate, estate);
 
+    if (estate->es_sample)
+        ExecSampleReport(estate);
+
+    if (estate->es_hwcounters)
+        ExecHwCountersReport(estate);
+
+    ExecCaptureEnd(estate);
+
     /* do away with our snapshots */
     UnregisterSnapshot(estate->es_snapshot);
     UnregisterSnapshot(estate->es_crosscheck_snapshot);
@@ -807,394 +1042,1037 @@ ExecCheckXactReadOnly(PlannedStmt *plannedstmt)
         PreventCommandIfParallelMode(CreateCommandName((Node *)plannedstmt));
 }
 
-/* ----------------------------------------------------------------
- *		InitPlan
+/*
+ * Return the child plans of a node other than lefttree and righttree.
+ */
+static List *
+ExecPlanChildren(Plan *plan)
+{
+    switch (nodeTag(plan))
+    {
+    case T_Append:
+        return ((Append *)plan)->appendplans;
+    case T_MergeAppend:
+        return ((MergeAppend *)plan)->mergeplans;
+    case T_ModifyTable:
+        return ((ModifyTable *)plan)->plans;
+    case T_BitmapAnd:
+        return ((BitmapAnd *)plan)->bitmapplans;
+    case T_BitmapOr:
+        return ((BitmapOr *)plan)->bitmapplans;
+    case T_CustomScan:
+        return ((CustomScan *)plan)->custom_plans;
+    case T_SubqueryScan:
+        return list_make1(((SubqueryScan *)plan)->subplan);
+    default:
+        return NIL;
+    }
+}
+
+/*
+ * Estimate the startup memory of a plan tree: each node gets a fixed
+ * allowance for its PlanState, slots and ExprContext, plus an allowance per
+ * targetlist and qual entry for the ExprState steps built from them.
+ * Counting the expressions keeps the first block of the startup context
+ * from being undersized for expression-heavy plans; it does not make the
+ * allocations contiguous (ExprContexts still live in es_query_cxt, and
+ * large chunks get blocks of their own).
+ */
+static Size
+ExecEstimatePlanSpace(Plan *plan)
+{
+    ListCell *lc;
+    Size space;
+
+    if (plan == NULL)
+        return 0;
+
+    check_stack_depth();
+
+    space = EXEC_STARTUP_BYTES_PER_NODE +
+            (list_length(plan->targetlist) + list_length(plan->qual)) *
+                EXEC_STARTUP_BYTES_PER_EXPR;
+    space = add_size(space, ExecEstimatePlanSpace(plan->lefttree));
+    space = add_size(space, ExecEstimatePlanSpace(plan->righttree));
+
+    foreach (lc, ExecPlanChildren(plan))
+        space = add_size(space, ExecEstimatePlanSpace((Plan *)lfirst(lc)));
+
+    return space;
+}
+
+/*
+ * Estimate how much memory executor startup will allocate for a plan.
  *
- *		Initializes the query plan: open files, allocate storage
- *		and start up the rule manager
- * ----------------------------------------------------------------
+ * This only needs to be in the right ballpark: it sizes the first block of
+ * the startup context, and the context simply grows if we guessed low.
  */
-/* ------------------------------------------------ ----------------
- * 初始化计划
+static Size
+ExecEstimateStartupSpace(PlannedStmt *plannedstmt)
+{
+    Size space;
+    ListCell *lc;
+
+    space = ExecEstimatePlanSpace(plannedstmt->planTree);
+    foreach (lc, plannedstmt->subplans)
+        space = add_size(space, ExecEstimatePlanSpace((Plan *)lfirst(lc)));
+
+    space = add_size(space,
+                     mul_size(list_length(plannedstmt->rtable),
+                              sizeof(RangeTblEntry *) + sizeof(Relation) +
+                                  sizeof(ExecRowMark *)));
+    space = add_size(space,
+                     mul_size(list_length(plannedstmt->resultRelations) +
+                                  list_length(plannedstmt->rootResultRelations),
+                              sizeof(ResultRelInfo)));
+    space = add_size(space,
+                     mul_size(list_length(plannedstmt->rowMarks),
+                              sizeof(ExecRowMark)));
+
+    return space;
+}
+
+/*
+ * Create the memory context that executor startup allocates in.
  *
- * 初始化查询计划：打开文件，分配存储
- * 并启动规则管理器
- * ------------------------------------------------- ---------------
+ * Small plans just use es_query_cxt.  For larger ones we make a child of
+ * es_query_cxt whose first block is big enough for the whole startup
+ * estimate, so that most of the small startup allocations are carved out
+ * of a single malloc.  Either way, the memory is released by
+ * FreeExecutorState.
  */
-static void
-InitPlan(QueryDesc *queryDesc, int eflags)
+static MemoryContext
+ExecCreateStartupContext(EState *estate, Size space)
 {
-    CmdType operation = queryDesc->operation;
-    PlannedStmt *plannedstmt = queryDesc->plannedstmt;
-    Plan *plan = plannedstmt->planTree;
-    List *rangeTable = plannedstmt->rtable;
-    EState *estate = queryDesc->estate;
-    PlanState *planstate;
-    TupleDesc tupType;
-    ListCell *l;
-    int i;
+    Size blocksize;
 
-    /*
-     * Do permissions checks
-     */
-    /*
-     * 做权限检查
-     */
-    ExecCheckRTPerms(rangeTable, true);
+    if (space <= ALLOCSET_DEFAULT_INITSIZE)
+        return estate->es_query_cxt;
 
-    /*
-     * initialize the node's execution state
-     */
-    /*
-     * 初始化节点的执行状态
-     */
-    ExecInitRangeTable(estate, rangeTable);
+    /* AllocSet wants power-of-2 block sizes */
+    blocksize = ALLOCSET_DEFAULT_INITSIZE;
+    while (blocksize < space && blocksize < EXEC_STARTUP_MAX_BLOCKSIZE)
+        blocksize <<= 1;
 
-    estate->es_plannedstmt = plannedstmt;
+    return AllocSetContextCreate(estate->es_query_cxt,
+                                 "ExecutorStartup",
+                                 blocksize,
+                                 blocksize,
+                                 Max(blocksize, ALLOCSET_DEFAULT_MAXSIZE));
+}
 
-    /*
-     * Initialize ResultRelInfo data structures, and open the result rels.
-     */
+/*
+ * Plan templates
+ *
+ * Prepared statements execute the same PlannedStmt over and over, and each
+ * time startup re-derives the same facts from it: the startup memory
+ * estimate and the count of memory-hungry nodes, both walks over the whole
+ * plan tree.  The executor also learns from past executions of a plan (see
+ * ExecRecordPlanRuntime and ExecPreferSerial).  For plans kept in the plan
+ * cache, which are the only ones executed more than once, we keep all this
+ * per PlannedStmt in a backend-local hash keyed by the plan's address.
+ * Custom plans live under CacheMemoryContext too, yet are normally executed
+ * only once, so a saved plan only gets a hash entry on its second
+ * execution; until then, as for all other plans, the template is built in
+ * es_query_cxt and dies with the query.  One-shot queries thus don't pay
+ * for a hash entry and a reset callback.  Which saved plans have been seen
+ * once is remembered in a small ring of recent plans; a plan that drops out
+ * of the ring before running again merely starts over.
+ *
+ * A template must not outlive its plan, or a later plan allocated at the
+ * same address would find it.  So we register a reset callback on the
+ * memory context holding the PlannedStmt, which forgets the template when
+ * the plan goes away; as an extra guard, we check that the plan's top-level
+ * pointers still match.
+ *
+ * Sharing templates across backends would need a pointer-free
+ * representation of everything cached here, so they are backend-local.
+ */
+struct ExecPlanTemplate
+{
+    PlannedStmt *plannedstmt; /* hash key --- must be first */
+    Plan *planTree;           /* plannedstmt->planTree when built */
+    List *rtable;             /* plannedstmt->rtable when built */
+    Size startup_space;       /* ExecEstimateStartupSpace() result */
+    int jit_flags;            /* JIT flags to execute with; see
+                               * ExecRecordPlanRuntime */
+    int jit_losses;           /* consecutive runs where JIT cost more than
+                               * it saved */
+    int jit_skipped;          /* runs since the planner's JIT flags were
+                               * last tried */
+    double stepped_run_time;  /* average run time with the stepped-down
+                               * JIT flags, in seconds, or -1 if unknown */
+    int memory_nodes;         /* ExecCountMemoryNodes() over all plans,
+                               * or -1 if not counted yet */
+    double parallel_run_time; /* average run time in parallel mode, in
+                               * seconds, or -1 if unknown */
+    double serial_run_time;   /* same, with parallel mode forced off */
+};
+
+static HTAB *ExecPlanTemplates = NULL;
+
+/* saved plans executed once so far; see ExecPlanSeenBefore */
+#define EXEC_PLANS_SEEN 16
+
+typedef struct ExecPlanSeen
+{
+    PlannedStmt *plannedstmt;
+    Plan *planTree;
+} ExecPlanSeen;
 
-    /*
-     * 初始化 ResultRelInfo 数据结构，并打开结果 rels.
-     */
+static ExecPlanSeen ExecPlansSeen[EXEC_PLANS_SEEN];
+static int ExecPlansSeenNext = 0;
 
-    if (plannedstmt->resultRelations)
+/*
+ * Is the plan held by a saved plan cache entry (or an SPI plan saved with
+ * SPI_keepplan)?  Those live under CacheMemoryContext, while plans for a
+ * single execution live in a message or portal context.
+ */
+static bool
+ExecPlanIsSaved(PlannedStmt *plannedstmt)
+{
+    MemoryContext cxt;
+
+    for (cxt = GetMemoryChunkContext(plannedstmt); cxt != NULL; cxt = cxt->parent)
     {
-        List *resultRelations = plannedstmt->resultRelations;
-        int numResultRelations = list_length(resultRelations);
-        ResultRelInfo *resultRelInfos;
-        ResultRelInfo *resultRelInfo;
+        if (cxt == CacheMemoryContext)
+            return true;
+    }
+    return false;
+}
 
-        resultRelInfos = (ResultRelInfo *)
-            palloc(numResultRelations * sizeof(ResultRelInfo));
-        resultRelInfo = resultRelInfos;
-        foreach (l, resultRelations)
-        {
-            Index resultRelationIndex = lfirst_int(l);
-            Relation resultRelation;
+/*
+ * Has this saved plan been executed before, without getting a template in
+ * the hash?  If not, remember it, so that its next execution does.
+ *
+ * A plan freed and replaced by another at the same address may be taken for
+ * the old one; that only costs the new plan its one-shot treatment.
+ */
+static bool
+ExecPlanSeenBefore(PlannedStmt *plannedstmt)
+{
+    int i;
 
-            resultRelation = ExecGetRangeTableRelation(estate,
-                                                       resultRelationIndex);
-            InitResultRelInfo(resultRelInfo,
-                              resultRelation,
-                              resultRelationIndex,
-                              NULL,
-                              estate->es_instrument);
-            resultRelInfo++;
+    for (i = 0; i < EXEC_PLANS_SEEN; i++)
+    {
+        ExecPlanSeen *seen = &ExecPlansSeen[i];
+
+        if (seen->plannedstmt == plannedstmt &&
+            seen->planTree == plannedstmt->planTree)
+        {
+            seen->plannedstmt = NULL;
+            seen->planTree = NULL;
+            return true;
         }
-        estate->es_result_relations = resultRelInfos;
-        estate->es_num_result_relations = numResultRelations;
+    }
 
-        /* es_result_relation_info is NULL except when within ModifyTable */
-        /* es_result_relation_info 为 NULL，除非在 ModifyTable 中*/
-        estate->es_result_relation_info = NULL;
+    ExecPlansSeen[ExecPlansSeenNext].plannedstmt = plannedstmt;
+    ExecPlansSeen[ExecPlansSeenNext].planTree = plannedstmt->planTree;
+    ExecPlansSeenNext = (ExecPlansSeenNext + 1) % EXEC_PLANS_SEEN;
+    return false;
+}
 
-        /*
-         * In the partitioned result relation case, also build ResultRelInfos
-         * for all the partitioned table roots, because we will need them to
-         * fire statement-level triggers, if any.
-         */
-        /*
-         * 在分区结果关系的情况下，还要构建ResultRelInfos
-         * 对于所有分区表根，因为我们需要它们
-         * 触发语句级触发器，如果有的话。
-         */
-        if (plannedstmt->rootResultRelations)
-        {
-            int num_roots = list_length(plannedstmt->rootResultRelations);
+/*
+ * Fill in the plan-derived fields of a template
+ */
+static void
+ExecFillPlanTemplate(ExecPlanTemplate *tmpl, PlannedStmt *plannedstmt)
+{
+    tmpl->planTree = plannedstmt->planTree;
+    tmpl->rtable = plannedstmt->rtable;
+    tmpl->startup_space = ExecEstimateStartupSpace(plannedstmt);
+    tmpl->jit_flags = plannedstmt->jitFlags;
+    tmpl->jit_losses = 0;
+    tmpl->jit_skipped = 0;
+    tmpl->stepped_run_time = -1;
+
+    tmpl->parallel_run_time = -1;
+    tmpl->serial_run_time = -1;
+
+    /* only needed with query_work_mem; see ExecBeginMemoryBudget */
+    tmpl->memory_nodes = -1;
+}
 
-            resultRelInfos = (ResultRelInfo *)
-                palloc(num_roots * sizeof(ResultRelInfo));
-            resultRelInfo = resultRelInfos;
-            foreach (l, plannedstmt->rootResultRelations)
-            {
-                Index resultRelIndex = lfirst_int(l);
-                Relation resultRelDesc;
+/*
+ * Build a template that lives only as long as the query.
+ */
+static ExecPlanTemplate *
+ExecTransientPlanTemplate(EState *estate, PlannedStmt *plannedstmt)
+{
+    ExecPlanTemplate *tmpl;
 
-                resultRelDesc = ExecGetRangeTableRelation(estate,
-                                                          resultRelIndex);
-                InitResultRelInfo(resultRelInfo,
-                                  resultRelDesc,
-                                  resultRelIndex,
-                                  NULL,
-                                  estate->es_instrument);
-                resultRelInfo++;
-            }
+    tmpl = (ExecPlanTemplate *)
+        MemoryContextAllocZero(estate->es_query_cxt, sizeof(ExecPlanTemplate));
+    tmpl->plannedstmt = plannedstmt;
+    ExecFillPlanTemplate(tmpl, plannedstmt);
 
-            estate->es_root_result_relations = resultRelInfos;
-            estate->es_num_root_result_relations = num_roots;
-        }
-        else
+    return tmpl;
+}
+
+/*
+ * Return the template for a plan, building it if necessary.
+ */
+static ExecPlanTemplate *
+ExecGetPlanTemplate(EState *estate, PlannedStmt *plannedstmt)
+{
+    ExecPlanTemplate *tmpl;
+    MemoryContext plancxt;
+    MemoryContextCallback *cb;
+    bool found;
+
+    if (!ExecPlanIsSaved(plannedstmt))
+        return ExecTransientPlanTemplate(estate, plannedstmt);
+
+    if (ExecPlanTemplates != NULL)
+    {
+        tmpl = (ExecPlanTemplate *)hash_search(ExecPlanTemplates,
+                                               &plannedstmt,
+                                               HASH_FIND,
+                                               NULL);
+        if (tmpl != NULL)
         {
-            estate->es_root_result_relations = NULL;
-            estate->es_num_root_result_relations = 0;
+            if (tmpl->planTree != plannedstmt->planTree ||
+                tmpl->rtable != plannedstmt->rtable)
+                ExecFillPlanTemplate(tmpl, plannedstmt);
+            return tmpl;
         }
     }
-    else
+
+    if (!ExecPlanSeenBefore(plannedstmt))
+        return ExecTransientPlanTemplate(estate, plannedstmt);
+
+    if (ExecPlanTemplates == NULL)
     {
-        /*
-         * if no result relation, then set state appropriately
-         */
-        estate->es_result_relations = NULL;
-        estate->es_num_result_relations = 0;
-        estate->es_result_relation_info = NULL;
-        estate->es_root_result_relations = NULL;
-        estate->es_num_root_result_relations = 0;
+        HASHCTL ctl;
+
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(PlannedStmt *);
+        ctl.entrysize = sizeof(ExecPlanTemplate);
+        ctl.hcxt = TopMemoryContext;
+        ExecPlanTemplates = hash_create("Executor plan templates", 256, &ctl,
+                                        HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
     }
 
-    /*
-     * Next, build the ExecRowMark array from the PlanRowMark(s), if any.
-     */
-    /*
-     * 接下来，如果有的话，从 PlanRowMark(s) 构建 ExecRowMark 数组。
-     */
-    if (plannedstmt->rowMarks)
-    {
-        estate->es_rowmarks = (ExecRowMark **)
-            palloc0(estate->es_range_table_size * sizeof(ExecRowMark *));
-        foreach (l, plannedstmt->rowMarks)
-        {
-            PlanRowMark *rc = (PlanRowMark *)lfirst(l);
-            Oid relid;
-            Relation relation;
-            ExecRowMark *erm;
+    tmpl = (ExecPlanTemplate *)hash_search(ExecPlanTemplates,
+                                           &plannedstmt,
+                                           HASH_ENTER,
+                                           &found);
+    Assert(!found);
 
-            /* ignore "parent" rowmarks; they are irrelevant at runtime */
-            if (rc->isParent)
-                continue;
+    plancxt = GetMemoryChunkContext(plannedstmt);
+    cb = (MemoryContextCallback *)
+        MemoryContextAlloc(plancxt, sizeof(MemoryContextCallback));
+    cb->func = ExecForgetPlanTemplate;
+    cb->arg = plannedstmt;
+    MemoryContextRegisterResetCallback(plancxt, cb);
 
-            /* get relation's OID (will produce InvalidOid if subquery) */
-            /*忽略“父”行标记；它们在运行时是无关紧要的*/
-            relid = exec_rt_fetch(rc->rti, estate)->relid;
+    ExecFillPlanTemplate(tmpl, plannedstmt);
 
-            /* open relation, if we need to access it for this mark type */
-            /*获取关系的 OID（如果子查询将产生 InvalidOid）*/
-            switch (rc->markType)
-            {
-            case ROW_MARK_EXCLUSIVE:
-            case ROW_MARK_NOKEYEXCLUSIVE:
-            case ROW_MARK_SHARE:
-            case ROW_MARK_KEYSHARE:
-            case ROW_MARK_REFERENCE:
-                relation = ExecGetRangeTableRelation(estate, rc->rti);
-                break;
-            case ROW_MARK_COPY:
-                /* no physical table access is required */
-                relation = NULL;
-                break;
-            default:
-                elog(ERROR, "unrecognized markType: %d", rc->markType);
-                relation = NULL; /* keep compiler quiet */
-                break;
-            }
+    return tmpl;
+}
 
-            /* Check that relation is a legal target for marking */
-            /*检查关系是否是标记的合法目标*/
-            if (relation)
-                CheckValidRowMarkRel(relation, rc->markType);
+/*
+ * Per-query memory budget
+ *
+ * Every sort, hash table and tuplestore in a plan is sized against
+ * work_mem independently, so a plan with many of them can use many times
+ * work_mem.  When query_work_mem is set, we divide it evenly among the
+ * plan's memory-hungry nodes and run each executor phase with work_mem
+ * lowered to that share; the nodes then spill to disk at their share, the
+ * same way they spill at work_mem today.  A node below a Gather or Gather
+ * Merge runs in every participant, each using its own share (a parallel
+ * hash table is sized at work_mem times the participants), so it counts
+ * once per planned worker plus once for the leader.  Workers inherit the
+ * lowered work_mem from the leader and leave it alone.  The setting is pushed with
+ * GUC_ACTION_SAVE at a new GUC nest level, like a function's SET clause, so
+ * an error in the middle of a phase restores it as part of abort.
+ */
+#define EXEC_MIN_WORK_MEM 64 /* kB, the lower limit of work_mem */
 
-            erm = (ExecRowMark *)palloc(sizeof(ExecRowMark));
-            erm->relation = relation;
-            erm->relid = relid;
-            erm->rti = rc->rti;
-            erm->prti = rc->prti;
-            erm->rowmarkId = rc->rowmarkId;
-            erm->markType = rc->markType;
-            erm->strength = rc->strength;
-            erm->waitPolicy = rc->waitPolicy;
-            erm->ermActive = false;
-            ItemPointerSetInvalid(&(erm->curCtid));
-            erm->ermExtra = NULL;
+typedef struct ExecCountMemoryContext
+{
+    int count;
+    int weight;
+} ExecCountMemoryContext;
 
-            Assert(erm->rti > 0 && erm->rti <= estate->es_range_table_size &&
-                   estate->es_rowmarks[erm->rti - 1] == NULL);
+static bool
+ExecCountMemoryNodesWalker(Node *node, void *context)
+{
+    ExecCountMemoryContext *cmc = (ExecCountMemoryContext *)context;
 
-            estate->es_rowmarks[erm->rti - 1] = erm;
-        }
-    }
+    if (node == NULL)
+        return false;
+    if (IsA(node, SubPlan) && ((SubPlan *)node)->useHashTable)
+        cmc->count += cmc->weight;
+    return expression_tree_walker(node, ExecCountMemoryNodesWalker, context);
+}
 
-    /*
-     * Initialize the executor's tuple table to empty.
-     */
-    /*
-     * 将执行者的元组表初始化为空。
-     */
-    estate->es_tupleTable = NIL;
+/*
+ * Count the nodes of a plan tree that size their working memory by
+ * work_mem: sorts, hash tables (including those of hashed subplans) and
+ * tuplestores.  Each counts weight times, times the participants of any
+ * Gather or Gather Merge above it.
+ */
+static int
+ExecCountMemoryNodes(Plan *plan, int weight)
+{
+    ListCell *lc;
+    ExecCountMemoryContext cmc;
 
-    /* signal that this EState is not used for EPQ */
-    estate->es_epq_active = NULL;
+    if (plan == NULL)
+        return 0;
 
-    /*
-     * Initialize private state information for each SubPlan.  We must do this
-     * before running ExecInitNode on the main query tree, since
-     * ExecInitSubPlan expects to be able to find these entries.
-     */
-    /*
-     * 初始化每个子计划的私有状态信息。我们必须这样做
-     * 在主查询树上运行 ExecInitNode 之前，因为
-     * ExecInitSubPlan 期望能够找到这些条目。
-     */
-    Assert(estate->es_subplanstates == NIL);
-    i = 1; /* subplan indices count from 1 */
-           /*子计划索引从 1 开始计数*/
-    foreach (l, plannedstmt->subplans)
+    check_stack_depth();
+
+    cmc.count = 0;
+    cmc.weight = weight;
+
+    switch (nodeTag(plan))
     {
-        Plan *subplan = (Plan *)lfirst(l);
-        PlanState *subplanstate;
-        int sp_eflags;
+    case T_Hash:
+    case T_Sort:
+    case T_IncrementalSort:
+    case T_Material:
+    case T_WindowAgg:
+    case T_RecursiveUnion:
+        cmc.count += weight;
+        break;
+    case T_Agg:
+        if (((Agg *)plan)->aggstrategy != AGG_PLAIN)
+            cmc.count += weight;
+        break;
+    case T_SetOp:
+        if (((SetOp *)plan)->strategy == SETOP_HASHED)
+            cmc.count += weight;
+        break;
+    default:
+        break;
+    }
 
-        /*
-         * A subplan will never need to do BACKWARD scan nor MARK/RESTORE. If
-         * it is a parameterless subplan (not initplan), we suggest that it be
-         * prepared to handle REWIND efficiently; otherwise there is no need.
-         */
-        /*
-         * 子计划永远不需要做 BACKWARD 扫描或 MARK/RESTORE。如果
-         * 它是一个无参数的子计划（不是 initplan），我们建议它是
-         * 准备好有效地处理 REWIND；否则没有必要。
-         */
-        sp_eflags = eflags & (EXEC_FLAG_EXPLAIN_ONLY | EXEC_FLAG_WITH_NO_DATA);
-        if (bms_is_member(i, plannedstmt->rewindPlanIDs))
-            sp_eflags |= EXEC_FLAG_REWIND;
+    (void)ExecCountMemoryNodesWalker((Node *)plan->targetlist, &cmc);
+    (void)ExecCountMemoryNodesWalker((Node *)plan->qual, &cmc);
 
-        subplanstate = ExecInitNode(subplan, estate, sp_eflags);
+    /* the subplan of a Gather runs in the leader and in each worker */
+    if (IsA(plan, Gather))
+        weight *= ((Gather *)plan)->num_workers + 1;
+    else if (IsA(plan, GatherMerge))
+        weight *= ((GatherMerge *)plan)->num_workers + 1;
 
-        estate->es_subplanstates = lappend(estate->es_subplanstates,
-                                           subplanstate);
+    cmc.count += ExecCountMemoryNodes(plan->lefttree, weight);
+    cmc.count += ExecCountMemoryNodes(plan->righttree, weight);
+    foreach (lc, ExecPlanChildren(plan))
+        cmc.count += ExecCountMemoryNodes((Plan *)lfirst(lc), weight);
 
-        i++;
+    return cmc.count;
+}
+
+/*
+ * Lower work_mem to this query's share of query_work_mem for the duration
+ * of an executor phase.  Returns the GUC nest level to pass to
+ * ExecEndMemoryBudget, or -1 if work_mem was left alone.
+ */
+static int
+ExecBeginMemoryBudget(EState *estate)
+{
+    ExecPlanTemplate *tmpl = estate->es_plan_template;
+    ListCell *lc;
+    int share;
+    int nestlevel;
+    char buf[32];
+
+    if (query_work_mem <= 0 || tmpl == NULL || IsParallelWorker())
+        return -1;
+
+    if (tmpl->memory_nodes < 0)
+    {
+        PlannedStmt *plannedstmt = tmpl->plannedstmt;
+
+        tmpl->memory_nodes = ExecCountMemoryNodes(plannedstmt->planTree, 1);
+        foreach (lc, plannedstmt->subplans)
+            tmpl->memory_nodes += ExecCountMemoryNodes((Plan *)lfirst(lc), 1);
     }
+    if (tmpl->memory_nodes == 0)
+        return -1;
+
+    share = Max(query_work_mem / tmpl->memory_nodes, EXEC_MIN_WORK_MEM);
+    if (share >= work_mem)
+        return -1;
+
+    nestlevel = NewGUCNestLevel();
+    snprintf(buf, sizeof(buf), "%d", share);
+    (void)set_config_option("work_mem", buf,
+                            PGC_USERSET, PGC_S_SESSION,
+                            GUC_ACTION_SAVE, true, 0, false);
+    return nestlevel;
+}
 
-    /*
-     * Initialize the private state information for all the nodes in the query
-     * tree.  This opens files, allocates storage and leaves us ready to start
-     * processing tuples.
-     */
+static void
+ExecEndMemoryBudget(int nestlevel)
+{
+    if (nestlevel >= 0)
+        AtEOXact_GUC(true, nestlevel);
+}
 
-    /*
-     * 初始化查询中所有节点的私有状态信息
-     * 树。这会打开文件，分配存储空间，让我们准备好开始
-     * 处理元组。
-     */
-    planstate = ExecInitNode(plan, estate, eflags);
+/*
+ * Record what an execution of a plan cost, for use by later executions.
+ *
+ * JIT-compiled code can't be reused across executions, since it embeds the
+ * addresses of per-execution state, so each execution of a JIT-enabled plan
+ * pays for optimization and emission again.  When that keeps costing more
+ * than running the query itself, step the plan's JIT flags down: first drop
+ * inlining and expensive optimization, then JIT altogether.
+ *
+ * Called at the end of a single-call ExecutorRun only; a partial fetch from
+ * a cursor says nothing about what the whole execution costs.  Expression
+ * IR is generated during ExecutorStart, so generation_counter is not part
+ * of es_run_time and is left out of the comparison; inlining, optimization
+ * and emission happen lazily at first evaluation, inside the run.
+ *
+ * A single cheap execution (say, for a parameter value matching few rows)
+ * should not cost the plan its JIT, so the flags are only stepped down
+ * after ADAPTIVE_JIT_LOSSES losing runs in a row.  Once stepped down, every
+ * ADAPTIVE_JIT_REPROBE'th execution runs with the planner's flags again
+ * (see standard_ExecutorStart).
+ *
+ * JIT makes the rest of the run faster, so a probe's run time alone says
+ * little about what running without JIT would cost.  Runs with the
+ * stepped-down flags are therefore timed as well, and their average kept in
+ * the template; a re-probe wins, and the flags go back to the planner's
+ * choice, if its JIT time plus run time beats that average.  While the
+ * average is known, a run with JIT only counts as a loss if it is slower
+ * than the average too.  The flags also go back whenever the plan is
+ * rebuilt.
+ */
+static void
+ExecRecordPlanRuntime(EState *estate)
+{
+    ExecPlanTemplate *tmpl = estate->es_plan_template;
+    JitInstrumentation *ji;
+    double total_time;
+    double jit_time = 0;
+    double run_time;
+    bool lost;
+
+    if (tmpl == NULL)
+        return;
 
-    /*
-     * Get the tuple descriptor describing the type of tuples to return.
-     */
-    tupType = ExecGetResultType(planstate);
-    /*
-     * 获取描述要返回的元组类型的元组描述符。
-     */
+    total_time = INSTR_TIME_GET_DOUBLE(estate->es_run_time);
+    if (estate->es_jit != NULL)
+    {
+        ji = &estate->es_jit->instr;
+        jit_time = INSTR_TIME_GET_DOUBLE(ji->inlining_counter) +
+                   INSTR_TIME_GET_DOUBLE(ji->optimization_counter) +
+                   INSTR_TIME_GET_DOUBLE(ji->emission_counter);
+    }
+    run_time = Max(total_time - jit_time, 0.0);
 
-    /*
-     * Initialize the junk filter if needed.  SELECT queries need a filter if
-     * there are any junk attrs in the top-level tlist.
-     */
-    /*
-     * 如果需要，初始化垃圾过滤器。SELECT 查询需要一个过滤器，如果
-     * 顶级 tlist 中有任何垃圾属性。
-     */
-    if (operation == CMD_SELECT)
+    if (tmpl->jit_flags == estate->es_plannedstmt->jitFlags ||
+        estate->es_jit_flags != tmpl->jit_flags)
     {
-        bool junk_filter_needed = false;
-        ListCell *tlist;
+        /*
+         * A run with the planner's flags, either because they were never
+         * stepped down or as a re-probe: compare against the stepped-down
+         * runs if we have timed any.
+         */
+        if (tmpl->stepped_run_time >= 0)
+            lost = total_time >= tmpl->stepped_run_time;
+        else
+            lost = jit_time > run_time;
 
-        foreach (tlist, plan->targetlist)
+        if (estate->es_jit_flags != tmpl->jit_flags)
         {
-            TargetEntry *tle = (TargetEntry *)lfirst(tlist);
-
-            if (tle->resjunk)
+            /* a losing re-probe just leaves the stepped-down flags alone */
+            if (!lost)
             {
-                junk_filter_needed = true;
-                break;
+                tmpl->jit_flags = estate->es_jit_flags;
+                tmpl->jit_losses = 0;
             }
+            return;
         }
+    }
+    else
+    {
+        /* a run with stepped-down flags; fold it into their average */
+        if (tmpl->stepped_run_time < 0)
+            tmpl->stepped_run_time = total_time;
+        else
+            tmpl->stepped_run_time = 0.75 * tmpl->stepped_run_time +
+                                     0.25 * total_time;
+        lost = jit_time > run_time;
+    }
 
-        if (junk_filter_needed)
-        {
-            JunkFilter *j;
-            TupleTableSlot *slot;
-
-            slot = ExecInitExtraTupleSlot(estate, NULL, &TTSOpsVirtual);
-            j = ExecInitJunkFilter(planstate->plan->targetlist,
-                                   slot);
-            estate->es_junkFilter = j;
+    /* nothing more to learn if this run did no JIT compilation */
+    if (estate->es_jit == NULL)
+        return;
 
-            /* Want to return the cleaned tuple type */
-            tupType = j->jf_cleanTupType;
-        }
+    if (!lost)
+    {
+        tmpl->jit_losses = 0;
+        return;
     }
 
-    queryDesc->tupDesc = tupType;
-    queryDesc->planstate = planstate;
+    if (++tmpl->jit_losses < ADAPTIVE_JIT_LOSSES)
+        return;
+
+    tmpl->jit_losses = 0;
+    tmpl->jit_skipped = 0;
+    tmpl->stepped_run_time = -1;
+    if (tmpl->jit_flags & (PGJIT_OPT3 | PGJIT_INLINE))
+        tmpl->jit_flags &= ~(PGJIT_OPT3 | PGJIT_INLINE);
+    else
+        tmpl->jit_flags = PGJIT_NONE;
 }
 
 /*
- * Check that a proposed result relation is a legal target for the operation
- *
- * Generally the parser and/or planner should have noticed any such mistake
- * already, but let's make sure.
+ * Should a plan that wants parallel mode run without it this time?
  *
- * Note: when changing this function, you probably also need to look at
- * CheckValidRowMarkRel.
+ * Launching workers takes a few milliseconds, which for a short query can
+ * be more than the workers save.  Once a parallel plan has been seen to
+ * finish within adaptive_parallel_threshold, try it once with parallel mode
+ * off (Gather nodes then run their subplans in the leader alone), and from
+ * then on use whichever mode has been faster on average.  Since only the
+ * mode in use gets timed, a serial run that grows slower than the last
+ * known parallel runs switches the plan back.
  */
-void CheckValidResultRel(ResultRelInfo *resultRelInfo, CmdType operation)
+static bool
+ExecPreferSerial(ExecPlanTemplate *tmpl)
 {
-    Relation resultRel = resultRelInfo->ri_RelationDesc;
-    TriggerDesc *trigDesc = resultRel->trigdesc;
-    FdwRoutine *fdwroutine;
+    if (adaptive_parallel_threshold <= 0 || tmpl == NULL ||
+        tmpl->parallel_run_time < 0)
+        return false;
 
-    switch (resultRel->rd_rel->relkind)
-    {
-    case RELKIND_RELATION:
-    case RELKIND_PARTITIONED_TABLE:
-        CheckCmdReplicaIdentity(resultRel, operation);
-        break;
-    case RELKIND_SEQUENCE:
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot change sequence \"%s\"",
-                        RelationGetRelationName(resultRel))));
-        break;
-    case RELKIND_TOASTVALUE:
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot change TOAST relation \"%s\"",
-                        RelationGetRelationName(resultRel))));
-        break;
-    case RELKIND_VIEW:
+    if (tmpl->serial_run_time >= 0)
+        return tmpl->serial_run_time < tmpl->parallel_run_time;
 
-        /*
-         * Okay only if there's a suitable INSTEAD OF trigger.  Messages
-         * here should match rewriteHandler.c's rewriteTargetView and
-         * RewriteQuery, except that we omit errdetail because we haven't
-         * got the information handy (and given that we really shouldn't
-         * get here anyway, it's not worth great exertion to get).
-         */
-        switch (operation)
-        {
-        case CMD_INSERT:
-            if (!trigDesc || !trigDesc->trig_insert_instead_row)
-                ereport(ERROR,
-                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-                         errmsg("cannot insert into view \"%s\"",
-                                RelationGetRelationName(resultRel)),
-                         errhint("To enable inserting into the view, provide an INSTEAD OF INSERT trigger or an unconditional ON INSERT DO INSTEAD rule.")));
-            break;
-        case CMD_UPDATE:
-            if (!trigDesc || !trigDesc->trig_update_instead_row)
-                ereport(ERROR,
-                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-                         errmsg("cannot update view \"%s\"",
-                                RelationGetRelationName(resultRel)),
-                         errhint("To enable updating the view, provide an INSTEAD OF UPDATE trigger or an unconditional ON UPDATE DO INSTEAD rule.")));
-            break;
-        case CMD_DELETE:
-            if (!trigDesc || !trigDesc->trig_delete_instead_row)
-                ereport(ERROR,
-                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+    return tmpl->parallel_run_time * 1000.0 < adaptive_parallel_threshold;
+}
+
+/*
+ * Fold the run time of a complete execution into the plan's average for
+ * the mode it ran in.
+ */
+static void
+ExecRecordParallelRuntime(ExecPlanTemplate *tmpl, bool parallel,
+                          double run_time)
+{
+    double *avg = parallel ? &tmpl->parallel_run_time : &tmpl->serial_run_time;
+
+    if (*avg < 0)
+        *avg = run_time;
+    else
+        *avg = 0.75 * *avg + 0.25 * run_time;
+}
+
+/*
+ * Memory context reset callback: the plan is going away, so drop its
+ * template.
+ */
+static void
+ExecForgetPlanTemplate(void *arg)
+{
+    PlannedStmt *plannedstmt = (PlannedStmt *)arg;
+
+    (void)hash_search(ExecPlanTemplates, &plannedstmt, HASH_REMOVE, NULL);
+}
+
+/* ----------------------------------------------------------------
+ *		InitPlan
+ *
+ *		Initializes the query plan: open files, allocate storage
+ *		and start up the rule manager
+ * ----------------------------------------------------------------
+ */
+/* ------------------------------------------------ ----------------
+ * 初始化计划
+ *
+ * 初始化查询计划：打开文件，分配存储
+ * 并启动规则管理器
+ * ------------------------------------------------- ---------------
+ */
+static void
+InitPlan(QueryDesc *queryDesc, int eflags)
+{
+    CmdType operation = queryDesc->operation;
+    PlannedStmt *plannedstmt = queryDesc->plannedstmt;
+    Plan *plan = plannedstmt->planTree;
+    List *rangeTable = plannedstmt->rtable;
+    EState *estate = queryDesc->estate;
+    PlanState *planstate;
+    TupleDesc tupType;
+    ListCell *l;
+    int i;
+
+    /*
+     * Do permissions checks
+     */
+    /*
+     * 做权限检查
+     */
+    ExecCheckRTPerms(rangeTable, true);
+
+    /*
+     * initialize the node's execution state
+     */
+    /*
+     * 初始化节点的执行状态
+     */
+    ExecInitRangeTable(estate, rangeTable);
+
+    estate->es_plannedstmt = plannedstmt;
+
+    /*
+     * Initialize ResultRelInfo data structures, and open the result rels.
+     */
+
+    /*
+     * 初始化 ResultRelInfo 数据结构，并打开结果 rels.
+     */
+
+    if (plannedstmt->resultRelations)
+    {
+        List *resultRelations = plannedstmt->resultRelations;
+        int numResultRelations = list_length(resultRelations);
+        ResultRelInfo *resultRelInfos;
+        ResultRelInfo *resultRelInfo;
+
+        resultRelInfos = (ResultRelInfo *)
+            palloc(numResultRelations * sizeof(ResultRelInfo));
+        resultRelInfo = resultRelInfos;
+        foreach (l, resultRelations)
+        {
+            Index resultRelationIndex = lfirst_int(l);
+            Relation resultRelation;
+
+            resultRelation = ExecGetRangeTableRelation(estate,
+                                                       resultRelationIndex);
+            InitResultRelInfo(resultRelInfo,
+                              resultRelation,
+                              resultRelationIndex,
+                              NULL,
+                              estate->es_instrument);
+            resultRelInfo++;
+        }
+        estate->es_result_relations = resultRelInfos;
+        estate->es_num_result_relations = numResultRelations;
+
+        /* es_result_relation_info is NULL except when within ModifyTable */
+        /* es_result_relation_info 为 NULL，除非在 ModifyTable 中*/
+        estate->es_result_relation_info = NULL;
+
+        /*
+         * In the partitioned result relation case, also build ResultRelInfos
+         * for all the partitioned table roots, because we will need them to
+         * fire statement-level triggers, if any.
+         */
+        /*
+         * 在分区结果关系的情况下，还要构建ResultRelInfos
+         * 对于所有分区表根，因为我们需要它们
+         * 触发语句级触发器，如果有的话。
+         */
+        if (plannedstmt->rootResultRelations)
+        {
+            int num_roots = list_length(plannedstmt->rootResultRelations);
+
+            resultRelInfos = (ResultRelInfo *)
+                palloc(num_roots * sizeof(ResultRelInfo));
+            resultRelInfo = resultRelInfos;
+            foreach (l, plannedstmt->rootResultRelations)
+            {
+                Index resultRelIndex = lfirst_int(l);
+                Relation resultRelDesc;
+
+                resultRelDesc = ExecGetRangeTableRelation(estate,
+                                                          resultRelIndex);
+                InitResultRelInfo(resultRelInfo,
+                                  resultRelDesc,
+                                  resultRelIndex,
+                                  NULL,
+                                  estate->es_instrument);
+                resultRelInfo++;
+            }
+
+            estate->es_root_result_relations = resultRelInfos;
+            estate->es_num_root_result_relations = num_roots;
+        }
+        else
+        {
+            estate->es_root_result_relations = NULL;
+            estate->es_num_root_result_relations = 0;
+        }
+    }
+    else
+    {
+        /*
+         * if no result relation, then set state appropriately
+         */
+        estate->es_result_relations = NULL;
+        estate->es_num_result_relations = 0;
+        estate->es_result_relation_info = NULL;
+        estate->es_root_result_relations = NULL;
+        estate->es_num_root_result_relations = 0;
+    }
+
+    /*
+     * Next, build the ExecRowMark array from the PlanRowMark(s), if any.
+     */
+    /*
+     * 接下来，如果有的话，从 PlanRowMark(s) 构建 ExecRowMark 数组。
+     */
+    if (plannedstmt->rowMarks)
+    {
+        estate->es_rowmarks = (ExecRowMark **)
+            palloc0(estate->es_range_table_size * sizeof(ExecRowMark *));
+        foreach (l, plannedstmt->rowMarks)
+        {
+            PlanRowMark *rc = (PlanRowMark *)lfirst(l);
+            Oid relid;
+            Relation relation;
+            ExecRowMark *erm;
+
+            /* ignore "parent" rowmarks; they are irrelevant at runtime */
+            if (rc->isParent)
+                continue;
+
+            /* get relation's OID (will produce InvalidOid if subquery) */
+            /*忽略“父”行标记；它们在运行时是无关紧要的*/
+            relid = exec_rt_fetch(rc->rti, estate)->relid;
+
+            /* open relation, if we need to access it for this mark type */
+            /*获取关系的 OID（如果子查询将产生 InvalidOid）*/
+            switch (rc->markType)
+            {
+            case ROW_MARK_EXCLUSIVE:
+            case ROW_MARK_NOKEYEXCLUSIVE:
+            case ROW_MARK_SHARE:
+            case ROW_MARK_KEYSHARE:
+            case ROW_MARK_REFERENCE:
+                relation = ExecGetRangeTableRelation(estate, rc->rti);
+                break;
+            case ROW_MARK_COPY:
+                /* no physical table access is required */
+                relation = NULL;
+                break;
+            default:
+                elog(ERROR, "unrecognized markType: %d", rc->markType);
+                relation = NULL; /* keep compiler quiet */
+                break;
+            }
+
+            /* Check that relation is a legal target for marking */
+            /*检查关系是否是标记的合法目标*/
+            if (relation)
+                CheckValidRowMarkRel(relation, rc->markType);
+
+            erm = (ExecRowMark *)palloc(sizeof(ExecRowMark));
+            erm->relation = relation;
+            erm->relid = relid;
+            erm->rti = rc->rti;
+            erm->prti = rc->prti;
+            erm->rowmarkId = rc->rowmarkId;
+            erm->markType = rc->markType;
+            erm->strength = rc->strength;
+            erm->waitPolicy = rc->waitPolicy;
+            erm->ermActive = false;
+            ItemPointerSetInvalid(&(erm->curCtid));
+            erm->ermExtra = NULL;
+
+            Assert(erm->rti > 0 && erm->rti <= estate->es_range_table_size &&
+                   estate->es_rowmarks[erm->rti - 1] == NULL);
+
+            estate->es_rowmarks[erm->rti - 1] = erm;
+        }
+    }
+
+    /*
+     * Initialize the executor's tuple table to empty.
+     */
+    /*
+     * 将执行者的元组表初始化为空。
+     */
+    estate->es_tupleTable = NIL;
+
+    /* signal that this EState is not used for EPQ */
+    estate->es_epq_active = NULL;
+
+    /*
+     * Initialize private state information for each SubPlan.  We must do this
+     * before running ExecInitNode on the main query tree, since
+     * ExecInitSubPlan expects to be able to find these entries.
+     */
+    /*
+     * 初始化每个子计划的私有状态信息。我们必须这样做
+     * 在主查询树上运行 ExecInitNode 之前，因为
+     * ExecInitSubPlan 期望能够找到这些条目。
+     */
+    Assert(estate->es_subplanstates == NIL);
+    i = 1; /* subplan indices count from 1 */
+           /*子计划索引从 1 开始计数*/
+    foreach (l, plannedstmt->subplans)
+    {
+        Plan *subplan = (Plan *)lfirst(l);
+        PlanState *subplanstate;
+        int sp_eflags;
+
+        /*
+         * A subplan will never need to do BACKWARD scan nor MARK/RESTORE. If
+         * it is a parameterless subplan (not initplan), we suggest that it be
+         * prepared to handle REWIND efficiently; otherwise there is no need.
+         */
+        /*
+         * 子计划永远不需要做 BACKWARD 扫描或 MARK/RESTORE。如果
+         * 它是一个无参数的子计划（不是 initplan），我们建议它是
+         * 准备好有效地处理 REWIND；否则没有必要。
+         */
+        sp_eflags = eflags & (EXEC_FLAG_EXPLAIN_ONLY | EXEC_FLAG_WITH_NO_DATA);
+        if (bms_is_member(i, plannedstmt->rewindPlanIDs))
+            sp_eflags |= EXEC_FLAG_REWIND;
+
+        subplanstate = ExecInitNode(subplan, estate, sp_eflags);
+
+        estate->es_subplanstates = lappend(estate->es_subplanstates,
+                                           subplanstate);
+
+        i++;
+    }
+
+    /*
+     * Initialize the private state information for all the nodes in the query
+     * tree.  This opens files, allocates storage and leaves us ready to start
+     * processing tuples.
+     */
+
+    /*
+     * 初始化查询中所有节点的私有状态信息
+     * 树。这会打开文件，分配存储空间，让我们准备好开始
+     * 处理元组。
+     */
+    planstate = ExecInitNode(plan, estate, eflags);
+
+    /*
+     * Get the tuple descriptor describing the type of tuples to return.
+     */
+    tupType = ExecGetResultType(planstate);
+    /*
+     * 获取描述要返回的元组类型的元组描述符。
+     */
+
+    /*
+     * Initialize the junk filter if needed.  SELECT queries need a filter if
+     * there are any junk attrs in the top-level tlist.
+     */
+    /*
+     * 如果需要，初始化垃圾过滤器。SELECT 查询需要一个过滤器，如果
+     * 顶级 tlist 中有任何垃圾属性。
+     */
+    if (operation == CMD_SELECT)
+    {
+        bool junk_filter_needed = false;
+        ListCell *tlist;
+
+        foreach (tlist, plan->targetlist)
+        {
+            TargetEntry *tle = (TargetEntry *)lfirst(tlist);
+
+            if (tle->resjunk)
+            {
+                junk_filter_needed = true;
+                break;
+            }
+        }
+
+        if (junk_filter_needed)
+        {
+            JunkFilter *j;
+            TupleTableSlot *slot;
+
+            slot = ExecInitExtraTupleSlot(estate, NULL, &TTSOpsVirtual);
+            j = ExecInitJunkFilter(planstate->plan->targetlist,
+                                   slot);
+            estate->es_junkFilter = j;
+
+            /* Want to return the cleaned tuple type */
+            tupType = j->jf_cleanTupType;
+        }
+    }
+
+    /*
+     * Set up the sampling profiler, if wanted.
+     */
+    /*
+     * 如需要, 设置采样分析器.
+     */
+    if (executor_sample_interval > 0 && !estate->es_instrument &&
+        !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+        ExecSampleInit(estate, planstate);
+
+    queryDesc->tupDesc = tupType;
+    queryDesc->planstate = planstate;
+}
+
+/*
+ * Check that a proposed result relation is a legal target for the operation
+ *
+ * Generally the parser and/or planner should have noticed any such mistake
+ * already, but let's make sure.
+ *
+ * Note: when changing this function, you probably also need to look at
+ * CheckValidRowMarkRel.
+ */
+void CheckValidResultRel(ResultRelInfo *resultRelInfo, CmdType operation)
+{
+    Relation resultRel = resultRelInfo->ri_RelationDesc;
+    TriggerDesc *trigDesc = resultRel->trigdesc;
+    FdwRoutine *fdwroutine;
+
+    switch (resultRel->rd_rel->relkind)
+    {
+    case RELKIND_RELATION:
+    case RELKIND_PARTITIONED_TABLE:
+        CheckCmdReplicaIdentity(resultRel, operation);
+        break;
+    case RELKIND_SEQUENCE:
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot change sequence \"%s\"",
+                        RelationGetRelationName(resultRel))));
+        break;
+    case RELKIND_TOASTVALUE:
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot change TOAST relation \"%s\"",
+                        RelationGetRelationName(resultRel))));
+        break;
+    case RELKIND_VIEW:
+
+        /*
+         * Okay only if there's a suitable INSTEAD OF trigger.  Messages
+         * here should match rewriteHandler.c's rewriteTargetView and
+         * RewriteQuery, except that we omit errdetail because we haven't
+         * got the information handy (and given that we really shouldn't
+         * get here anyway, it's not worth great exertion to get).
+         */
+        switch (operation)
+        {
+        case CMD_INSERT:
+            if (!trigDesc || !trigDesc->trig_insert_instead_row)
+                ereport(ERROR,
+                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                         errmsg("cannot insert into view \"%s\"",
+                                RelationGetRelationName(resultRel)),
+                         errhint("To enable inserting into the view, provide an INSTEAD OF INSERT trigger or an unconditional ON INSERT DO INSTEAD rule.")));
+            break;
+        case CMD_UPDATE:
+            if (!trigDesc || !trigDesc->trig_update_instead_row)
+                ereport(ERROR,
+                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                         errmsg("cannot update view \"%s\"",
+                                RelationGetRelationName(resultRel)),
+                         errhint("To enable updating the view, provide an INSTEAD OF UPDATE trigger or an unconditional ON UPDATE DO INSTEAD rule.")));
+            break;
+        case CMD_DELETE:
+            if (!trigDesc || !trigDesc->trig_delete_instead_row)
+                ereport(ERROR,
+                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
                          errmsg("cannot delete from view \"%s\"",
                                 RelationGetRelationName(resultRel)),
                          errhint("To enable deleting from the view, provide an INSTEAD OF DELETE trigger or an unconditional ON DELETE DO INSTEAD rule.")));
@@ -1203,342 +2081,1313 @@ void CheckValidResultRel(ResultRelInfo *resultRelInfo, CmdType operation)
             elog(ERROR, "unrecognized CmdType: %d", (int)operation);
             break;
         }
-        break;
-    case RELKIND_MATVIEW:
-        if (!MatViewIncrementalMaintenanceIsEnabled())
-            ereport(ERROR,
-                    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                     errmsg("cannot change materialized view \"%s\"",
-                            RelationGetRelationName(resultRel))));
-        break;
-    case RELKIND_FOREIGN_TABLE:
-        /* Okay only if the FDW supports it */
-        fdwroutine = resultRelInfo->ri_FdwRoutine;
-        switch (operation)
+        break;
+    case RELKIND_MATVIEW:
+        if (!MatViewIncrementalMaintenanceIsEnabled())
+            ereport(ERROR,
+                    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                     errmsg("cannot change materialized view \"%s\"",
+                            RelationGetRelationName(resultRel))));
+        break;
+    case RELKIND_FOREIGN_TABLE:
+        /* Okay only if the FDW supports it */
+        fdwroutine = resultRelInfo->ri_FdwRoutine;
+        switch (operation)
+        {
+        case CMD_INSERT:
+            if (fdwroutine->ExecForeignInsert == NULL)
+                ereport(ERROR,
+                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                         errmsg("cannot insert into foreign table \"%s\"",
+                                RelationGetRelationName(resultRel))));
+            if (fdwroutine->IsForeignRelUpdatable != NULL &&
+                (fdwroutine->IsForeignRelUpdatable(resultRel) & (1 << CMD_INSERT)) == 0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                         errmsg("foreign table \"%s\" does not allow inserts",
+                                RelationGetRelationName(resultRel))));
+            break;
+        case CMD_UPDATE:
+            if (fdwroutine->ExecForeignUpdate == NULL)
+                ereport(ERROR,
+                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                         errmsg("cannot update foreign table \"%s\"",
+                                RelationGetRelationName(resultRel))));
+            if (fdwroutine->IsForeignRelUpdatable != NULL &&
+                (fdwroutine->IsForeignRelUpdatable(resultRel) & (1 << CMD_UPDATE)) == 0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                         errmsg("foreign table \"%s\" does not allow updates",
+                                RelationGetRelationName(resultRel))));
+            break;
+        case CMD_DELETE:
+            if (fdwroutine->ExecForeignDelete == NULL)
+                ereport(ERROR,
+                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                         errmsg("cannot delete from foreign table \"%s\"",
+                                RelationGetRelationName(resultRel))));
+            if (fdwroutine->IsForeignRelUpdatable != NULL &&
+                (fdwroutine->IsForeignRelUpdatable(resultRel) & (1 << CMD_DELETE)) == 0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                         errmsg("foreign table \"%s\" does not allow deletes",
+                                RelationGetRelationName(resultRel))));
+            break;
+        default:
+            elog(ERROR, "unrecognized CmdType: %d", (int)operation);
+            break;
+        }
+        break;
+    default:
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot change relation \"%s\"",
+                        RelationGetRelationName(resultRel))));
+        break;
+    }
+}
+
+/*
+ * Check that a proposed rowmark target relation is a legal target
+ *
+ * In most cases parser and/or planner should have noticed this already, but
+ * they don't cover all cases.
+ */
+static void
+CheckValidRowMarkRel(Relation rel, RowMarkType markType)
+{
+    FdwRoutine *fdwroutine;
+
+    switch (rel->rd_rel->relkind)
+    {
+    case RELKIND_RELATION:
+    case RELKIND_PARTITIONED_TABLE:
+        /* OK */
+        break;
+    case RELKIND_SEQUENCE:
+        /* Must disallow this because we don't vacuum sequences */
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot lock rows in sequence \"%s\"",
+                        RelationGetRelationName(rel))));
+        break;
+    case RELKIND_TOASTVALUE:
+        /* We could allow this, but there seems no good reason to */
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot lock rows in TOAST relation \"%s\"",
+                        RelationGetRelationName(rel))));
+        break;
+    case RELKIND_VIEW:
+        /* Should not get here; planner should have expanded the view */
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot lock rows in view \"%s\"",
+                        RelationGetRelationName(rel))));
+        break;
+    case RELKIND_MATVIEW:
+        /* Allow referencing a matview, but not actual locking clauses */
+        if (markType != ROW_MARK_REFERENCE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                     errmsg("cannot lock rows in materialized view \"%s\"",
+                            RelationGetRelationName(rel))));
+        break;
+    case RELKIND_FOREIGN_TABLE:
+        /* Okay only if the FDW supports it */
+        fdwroutine = GetFdwRoutineForRelation(rel, false);
+        if (fdwroutine->RefetchForeignRow == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("cannot lock rows in foreign table \"%s\"",
+                            RelationGetRelationName(rel))));
+        break;
+    default:
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot lock rows in relation \"%s\"",
+                        RelationGetRelationName(rel))));
+        break;
+    }
+}
+
+/*
+ * Initialize ResultRelInfo data for one result relation
+ *
+ * Caution: before Postgres 9.1, this function included the relkind checking
+ * that's now in CheckValidResultRel, and it also did ExecOpenIndices if
+ * appropriate.  Be sure callers cover those needs.
+ */
+void InitResultRelInfo(ResultRelInfo *resultRelInfo,
+                       Relation resultRelationDesc,
+                       Index resultRelationIndex,
+                       ResultRelInfo *partition_root_rri,
+                       int instrument_options)
+{
+    List *partition_check = NIL;
+
+    MemSet(resultRelInfo, 0, sizeof(ResultRelInfo));
+    resultRelInfo->type = T_ResultRelInfo;
+    resultRelInfo->ri_RangeTableIndex = resultRelationIndex;
+    resultRelInfo->ri_RelationDesc = resultRelationDesc;
+    resultRelInfo->ri_NumIndices = 0;
+    resultRelInfo->ri_IndexRelationDescs = NULL;
+    resultRelInfo->ri_IndexRelationInfo = NULL;
+    /* make a copy so as not to depend on relcache info not changing... */
+    resultRelInfo->ri_TrigDesc = CopyTriggerDesc(resultRelationDesc->trigdesc);
+    if (resultRelInfo->ri_TrigDesc)
+    {
+        int n = resultRelInfo->ri_TrigDesc->numtriggers;
+
+        resultRelInfo->ri_TrigFunctions = (FmgrInfo *)
+            palloc0(n * sizeof(FmgrInfo));
+        resultRelInfo->ri_TrigWhenExprs = (ExprState **)
+            palloc0(n * sizeof(ExprState *));
+        if (instrument_options)
+            resultRelInfo->ri_TrigInstrument = InstrAlloc(n, instrument_options);
+    }
+    else
+    {
+        resultRelInfo->ri_TrigFunctions = NULL;
+        resultRelInfo->ri_TrigWhenExprs = NULL;
+        resultRelInfo->ri_TrigInstrument = NULL;
+    }
+    if (resultRelationDesc->rd_rel->relkind == RELKIND_FOREIGN_TABLE)
+        resultRelInfo->ri_FdwRoutine = GetFdwRoutineForRelation(resultRelationDesc, true);
+    else
+        resultRelInfo->ri_FdwRoutine = NULL;
+
+    /* The following fields are set later if needed */
+    resultRelInfo->ri_FdwState = NULL;
+    resultRelInfo->ri_usesFdwDirectModify = false;
+    resultRelInfo->ri_ConstraintExprs = NULL;
+    resultRelInfo->ri_GeneratedExprs = NULL;
+    resultRelInfo->ri_junkFilter = NULL;
+    resultRelInfo->ri_projectReturning = NULL;
+    resultRelInfo->ri_onConflictArbiterIndexes = NIL;
+    resultRelInfo->ri_onConflict = NULL;
+    resultRelInfo->ri_ReturningSlot = NULL;
+    resultRelInfo->ri_TrigOldSlot = NULL;
+    resultRelInfo->ri_TrigNewSlot = NULL;
+
+    /*
+     * Partition constraint, which also includes the partition constraint of
+     * all the ancestors that are partitions.  Note that it will be checked
+     * even in the case of tuple-routing where this table is the target leaf
+     * partition, if there any BR triggers defined on the table.  Although
+     * tuple-routing implicitly preserves the partition constraint of the
+     * target partition for a given row, the BR triggers may change the row
+     * such that the constraint is no longer satisfied, which we must fail for
+     * by checking it explicitly.
+     *
+     * If this is a partitioned table, the partition constraint (if any) of a
+     * given row will be checked just before performing tuple-routing.
+     */
+    partition_check = RelationGetPartitionQual(resultRelationDesc);
+
+    resultRelInfo->ri_PartitionCheck = partition_check;
+    resultRelInfo->ri_RootResultRelInfo = partition_root_rri;
+    resultRelInfo->ri_PartitionInfo = NULL; /* may be set later */
+    resultRelInfo->ri_CopyMultiInsertBuffer = NULL;
+}
+
+/*
+ * ExecGetTriggerResultRel
+ *		Get a ResultRelInfo for a trigger target relation.
+ *
+ * Most of the time, triggers are fired on one of the result relations of the
+ * query, and so we can just return a member of the es_result_relations array,
+ * or the es_root_result_relations array (if any), or the
+ * es_tuple_routing_result_relations list (if any).  (Note: in self-join
+ * situations there might be multiple members with the same OID; if so it
+ * doesn't matter which one we pick.)
+ *
+ * However, it is sometimes necessary to fire triggers on other relations;
+ * this happens mainly when an RI update trigger queues additional triggers
+ * on other relations, which will be processed in the context of the outer
+ * query.  For efficiency's sake, we want to have a ResultRelInfo for those
+ * triggers too; that can avoid repeated re-opening of the relation.  (It
+ * also provides a way for EXPLAIN ANALYZE to report the runtimes of such
+ * triggers.)  So we make additional ResultRelInfo's as needed, and save them
+ * in es_trig_target_relations.
+ */
+ResultRelInfo *
+ExecGetTriggerResultRel(EState *estate, Oid relid)
+{
+    ResultRelInfo *rInfo;
+    int nr;
+    ListCell *l;
+    Relation rel;
+    MemoryContext oldcontext;
+
+    /* First, search through the query result relations */
+    rInfo = estate->es_result_relations;
+    nr = estate->es_num_result_relations;
+    while (nr > 0)
+    {
+        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
+            return rInfo;
+        rInfo++;
+        nr--;
+    }
+    /* Second, search through the root result relations, if any */
+    rInfo = estate->es_root_result_relations;
+    nr = estate->es_num_root_result_relations;
+    while (nr > 0)
+    {
+        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
+            return rInfo;
+        rInfo++;
+        nr--;
+    }
+
+    /*
+     * Third, search through the result relations that were created during
+     * tuple routing, if any.
+     */
+    foreach (l, estate->es_tuple_routing_result_relations)
+    {
+        rInfo = (ResultRelInfo *)lfirst(l);
+        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
+            return rInfo;
+    }
+
+    /* Nope, but maybe we already made an extra ResultRelInfo for it */
+    foreach (l, estate->es_trig_target_relations)
+    {
+        rInfo = (ResultRelInfo *)lfirst(l);
+        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
+            return rInfo;
+    }
+    /* Nope, so we need a new one */
+
+    /*
+     * Open the target relation's relcache entry.  We assume that an
+     * appropriate lock is still held by the backend from whenever the trigger
+     * event got queued, so we need take no new lock here.  Also, we need not
+     * recheck the relkind, so no need for CheckValidResultRel.
+     */
+    rel = table_open(relid, NoLock);
+
+    /*
+     * Make the new entry in the right context.
+     */
+    oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+    rInfo = makeNode(ResultRelInfo);
+    InitResultRelInfo(rInfo,
+                      rel,
+                      0, /* dummy rangetable index */
+                      NULL,
+                      estate->es_instrument);
+    estate->es_trig_target_relations =
+        lappend(estate->es_trig_target_relations, rInfo);
+    MemoryContextSwitchTo(oldcontext);
+
+    /*
+     * Currently, we don't need any index information in ResultRelInfos used
+     * only for triggers, so no need to call ExecOpenIndices.
+     */
+
+    return rInfo;
+}
+
+/*
+ * Close any relations that have been opened by ExecGetTriggerResultRel().
+ */
+void ExecCleanUpTriggerState(EState *estate)
+{
+    ListCell *l;
+
+    foreach (l, estate->es_trig_target_relations)
+    {
+        ResultRelInfo *resultRelInfo = (ResultRelInfo *)lfirst(l);
+
+        /*
+         * Assert this is a "dummy" ResultRelInfo, see above.  Otherwise we
+         * might be issuing a duplicate close against a Relation opened by
+         * ExecGetRangeTableRelation.
+         */
+        Assert(resultRelInfo->ri_RangeTableIndex == 0);
+
+        /*
+         * Since ExecGetTriggerResultRel doesn't call ExecOpenIndices for
+         * these rels, we needn't call ExecCloseIndices either.
+         */
+        Assert(resultRelInfo->ri_NumIndices == 0);
+
+        table_close(resultRelInfo->ri_RelationDesc, NoLock);
+    }
+}
+
+/*
+ * Workload capture
+ *
+ * When executor_capture_file is set, every top-level execution appends a
+ * record of what the executor was asked to do to that file: the source
+ * text, the serialized PlannedStmt, eflags, the values of external
+ * parameters, and each ExecutorRun call with its direction, fetch count
+ * and number of rows processed.  A replay tool can read the plans back
+ * with stringToNode and run them through the same ExecutorStart/Run/
+ * Finish/End sequence, so executor changes can be timed against a real
+ * statement mix.
+ *
+ * The record is built up in es_query_cxt and written at ExecutorEnd with a
+ * single write() on a descriptor opened with O_APPEND, so executions that
+ * fail leave nothing behind, and records from concurrent backends sharing
+ * the file land one after another rather than interleaved (a stdio stream
+ * would split a large record into several writes).  Variable-length items
+ * are written as "<tag> <length>" lines followed by that many bytes and a
+ * newline.
+ *
+ * Only top-level executions are captured: queries that functions or
+ * triggers run through SPI while another query is in ExecutorRun or
+ * ExecutorFinish are replayed by replaying the outer query.
+ * ExecNestLevel counts those phases, like pg_stat_statements does.  That
+ * misses deferred triggers, which fire at COMMIT with no query running, so
+ * queries started while any trigger is firing are skipped as well; they
+ * are replayed by replaying the statement that queued the trigger.
+ *
+ * executor_capture_file is PGC_SUSET and off (empty) by default: it names
+ * a file the server writes to, and records carry the query text and
+ * parameter values of every session capturing into it.
+ */
+
+/*
+ * How many triggers are firing in this backend?  trigger.c keeps the depth
+ * to itself, but exposes it as pg_trigger_depth(), which ignores its
+ * arguments.
+ */
+static int
+ExecTriggerDepth(void)
+{
+    LOCAL_FCINFO(fcinfo, 0);
+
+    InitFunctionCallInfoData(*fcinfo, NULL, 0, InvalidOid, NULL, NULL);
+    return DatumGetInt32(pg_trigger_depth(fcinfo));
+}
+
+static void
+ExecCaptureAppendText(StringInfo buf, const char *tag, const char *text)
+{
+    size_t len = text ? strlen(text) : 0;
+
+    appendStringInfo(buf, "%s %zu\n", tag, len);
+    if (len > 0)
+        appendBinaryStringInfo(buf, text, len);
+    appendStringInfoChar(buf, '\n');
+}
+
+static void
+ExecCaptureStart(QueryDesc *queryDesc, int eflags)
+{
+    EState *estate = queryDesc->estate;
+    ParamListInfo params = queryDesc->params;
+    StringInfo buf;
+    int i;
+
+    if (executor_capture_file == NULL || executor_capture_file[0] == '\0' ||
+        (eflags & EXEC_FLAG_EXPLAIN_ONLY) || IsParallelWorker() ||
+        ExecNestLevel > 0 || ExecTriggerDepth() > 0)
+        return;
+
+    buf = makeStringInfo();
+    appendStringInfo(buf, "query %d eflags %d\n", MyProcPid, eflags);
+    ExecCaptureAppendText(buf, "source", queryDesc->sourceText);
+    ExecCaptureAppendText(buf, "plan", nodeToString(queryDesc->plannedstmt));
+
+    if (params != NULL && params->paramFetch != NULL)
+        appendStringInfoString(buf, "params dynamic\n");
+    else if (params != NULL)
+    {
+        appendStringInfo(buf, "params %d\n", params->numParams);
+        for (i = 0; i < params->numParams; i++)
+        {
+            ParamExternData *prm = &params->params[i];
+            char label[64];
+
+            snprintf(label, sizeof(label), "param %u %d", prm->ptype, (int)prm->pflags);
+            if (prm->isnull || !OidIsValid(prm->ptype))
+                appendStringInfo(buf, "%s null\n", label);
+            else
+            {
+                Oid typoutput;
+                bool typisvarlena;
+
+                getTypeOutputInfo(prm->ptype, &typoutput, &typisvarlena);
+                ExecCaptureAppendText(buf, label,
+                                      OidOutputFunctionCall(typoutput, prm->value));
+            }
+        }
+    }
+
+    estate->es_capture = buf;
+}
+
+static void
+ExecCaptureRun(EState *estate, ScanDirection direction, uint64 count,
+               bool execute_once)
+{
+    if (estate->es_capture == NULL)
+        return;
+
+    appendStringInfo(estate->es_capture,
+                     "run %d " UINT64_FORMAT " %d " UINT64_FORMAT "\n",
+                     (int)direction, count, (int)execute_once,
+                     estate->es_processed);
+}
+
+static void
+ExecCaptureEnd(EState *estate)
+{
+    StringInfo buf = estate->es_capture;
+    int fd;
+
+    if (buf == NULL)
+        return;
+
+    appendStringInfoString(buf, "end\n");
+
+    fd = OpenTransientFile(executor_capture_file,
+                           O_WRONLY | O_APPEND | O_CREAT | PG_BINARY);
+    if (fd < 0)
+    {
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("could not open capture file \"%s\": %m",
+                        executor_capture_file)));
+        return;
+    }
+
+    errno = 0;
+    if (write(fd, buf->data, buf->len) != buf->len)
+    {
+        /* if write didn't set errno, assume problem is no disk space */
+        if (errno == 0)
+            errno = ENOSPC;
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("could not write to capture file \"%s\": %m",
+                        executor_capture_file)));
+    }
+
+    if (CloseTransientFile(fd) != 0)
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("could not close capture file \"%s\": %m",
+                        executor_capture_file)));
+}
+
+/*
+ * Per-query memory accounting
+ *
+ * Everything a query allocates lives under es_query_cxt, so the total at
+ * any moment is cheap to get from MemoryContextMemAllocated.  We sample it
+ * at the end of each executor phase and keep the highest value in
+ * es_mem_phase_max; since that's only done when log_executor_memory is on,
+ * other queries pay one test per phase.  (EXPLAIN ANALYZE doesn't report
+ * it, so instrumented queries don't need it.)
+ * This is not a true high-water mark: memory a node allocates and frees
+ * within ExecutorRun (a sort that spills, a rescanned hash table) doesn't
+ * show up, so it is reported as the largest phase-end size.
+ *
+ * ExecutorEnd also logs the usage of every context below es_query_cxt
+ * while the plan nodes still hold them, so that a blowup can be pinned on,
+ * say, a hash table or a sort.  Contexts are grouped by name, since every
+ * node creates ExprContexts of the same name, and the whole subtree is
+ * walked: node contexts may hang below the ExecutorStartup context or below
+ * other node contexts.  Each context counts only its own blocks, so that
+ * nothing is counted twice.
+ */
+#define ExecTracksMemory(estate) (log_executor_memory)
+
+typedef struct ExecMemGroup
+{
+    const char *name;
+    int ncontexts;
+    Size bytes;
+} ExecMemGroup;
+
+typedef struct ExecMemGroups
+{
+    ExecMemGroup *groups;
+    int ngroups;
+    int maxgroups;
+} ExecMemGroups;
+
+static void
+ExecNoteMemoryUsage(EState *estate)
+{
+    Size used;
+
+    if (!ExecTracksMemory(estate))
+        return;
+
+    used = MemoryContextMemAllocated(estate->es_query_cxt, true);
+    if (used > estate->es_mem_phase_max)
+        estate->es_mem_phase_max = used;
+}
+
+/*
+ * Add the memory of each context below parent to its name's group
+ */
+static void
+ExecGroupMemoryUsage(MemoryContext parent, ExecMemGroups *mg)
+{
+    MemoryContext cxt;
+    int i;
+
+    check_stack_depth();
+
+    for (cxt = parent->firstchild; cxt != NULL; cxt = cxt->nextchild)
+    {
+        for (i = 0; i < mg->ngroups; i++)
+        {
+            if (strcmp(mg->groups[i].name, cxt->name) == 0)
+                break;
+        }
+        if (i == mg->ngroups)
         {
-        case CMD_INSERT:
-            if (fdwroutine->ExecForeignInsert == NULL)
-                ereport(ERROR,
-                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                         errmsg("cannot insert into foreign table \"%s\"",
-                                RelationGetRelationName(resultRel))));
-            if (fdwroutine->IsForeignRelUpdatable != NULL &&
-                (fdwroutine->IsForeignRelUpdatable(resultRel) & (1 << CMD_INSERT)) == 0)
-                ereport(ERROR,
-                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-                         errmsg("foreign table \"%s\" does not allow inserts",
-                                RelationGetRelationName(resultRel))));
-            break;
-        case CMD_UPDATE:
-            if (fdwroutine->ExecForeignUpdate == NULL)
-                ereport(ERROR,
-                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                         errmsg("cannot update foreign table \"%s\"",
-                                RelationGetRelationName(resultRel))));
-            if (fdwroutine->IsForeignRelUpdatable != NULL &&
-                (fdwroutine->IsForeignRelUpdatable(resultRel) & (1 << CMD_UPDATE)) == 0)
-                ereport(ERROR,
-                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-                         errmsg("foreign table \"%s\" does not allow updates",
-                                RelationGetRelationName(resultRel))));
-            break;
-        case CMD_DELETE:
-            if (fdwroutine->ExecForeignDelete == NULL)
-                ereport(ERROR,
-                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                         errmsg("cannot delete from foreign table \"%s\"",
-                                RelationGetRelationName(resultRel))));
-            if (fdwroutine->IsForeignRelUpdatable != NULL &&
-                (fdwroutine->IsForeignRelUpdatable(resultRel) & (1 << CMD_DELETE)) == 0)
-                ereport(ERROR,
-                        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-                         errmsg("foreign table \"%s\" does not allow deletes",
-                                RelationGetRelationName(resultRel))));
-            break;
-        default:
-            elog(ERROR, "unrecognized CmdType: %d", (int)operation);
-            break;
+            if (mg->ngroups == mg->maxgroups)
+            {
+                mg->maxgroups *= 2;
+                mg->groups = (ExecMemGroup *)
+                    repalloc(mg->groups, mg->maxgroups * sizeof(ExecMemGroup));
+            }
+            mg->groups[i].name = cxt->name;
+            mg->groups[i].ncontexts = 0;
+            mg->groups[i].bytes = 0;
+            mg->ngroups++;
         }
-        break;
-    default:
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot change relation \"%s\"",
-                        RelationGetRelationName(resultRel))));
-        break;
+        mg->groups[i].ncontexts++;
+        mg->groups[i].bytes += MemoryContextMemAllocated(cxt, false);
+
+        ExecGroupMemoryUsage(cxt, mg);
     }
 }
 
+static void
+ExecReportMemoryUsage(EState *estate)
+{
+    ExecMemGroups mg;
+    StringInfoData buf;
+    Size used;
+    int i;
+
+    used = MemoryContextMemAllocated(estate->es_query_cxt, true);
+    if (used > estate->es_mem_phase_max)
+        estate->es_mem_phase_max = used;
+
+    mg.ngroups = 0;
+    mg.maxgroups = 16;
+    mg.groups = (ExecMemGroup *)palloc(mg.maxgroups * sizeof(ExecMemGroup));
+    ExecGroupMemoryUsage(estate->es_query_cxt, &mg);
+
+    initStringInfo(&buf);
+    for (i = 0; i < mg.ngroups; i++)
+        appendStringInfo(&buf, "\n%s (%d): %zu bytes",
+                         mg.groups[i].name, mg.groups[i].ncontexts,
+                         mg.groups[i].bytes);
+
+    ereport(LOG,
+            (errmsg("executor memory: %zu bytes at largest phase end, %zu bytes at end%s",
+                    estate->es_mem_phase_max, used, buf.data)));
+
+    pfree(buf.data);
+    pfree(mg.groups);
+}
+
 /*
- * Check that a proposed rowmark target relation is a legal target
+ * Hardware performance counters per executor phase
  *
- * In most cases parser and/or planner should have noticed this already, but
- * they don't cover all cases.
+ * When executor_hwcounters is on, each backend opens (once) a Linux
+ * perf_event group counting CPU cycles, retired instructions, cache misses
+ * and branch misses in user space of this process.  The group runs
+ * continuously; each executor phase just reads it when starting and
+ * stopping, which is one read() call each, and accumulates the difference
+ * in estate->es_hwcounters.  The per-phase totals are logged at
+ * ExecutorEnd, which is enough to tell a memory-bound query (low
+ * instructions per cycle, many cache misses) from a CPU-bound one.
+ *
+ * When more events are requested than the PMU has registers, the kernel
+ * multiplexes groups and each one only counts part of the time.  We read
+ * the group's enabled and running times along with the values, and scale
+ * each phase's deltas by enabled/running, as perf stat does.
+ *
+ * The descriptors are counted against max_files_per_process through
+ * AcquireExternalFD, and opened close-on-exec so that programs started
+ * by COPY ... PROGRAM and archive_command don't inherit them.
+ *
+ * If perf_event_open isn't available or is refused (kernel.perf_event_paranoid),
+ * we warn once and behave as if the parameter were off.
+ */
+#define EXEC_HW_NCOUNTERS 4
+
+/* read() of the group: nr, time_enabled, time_running, then the values */
+#define EXEC_HW_ENABLED 0
+#define EXEC_HW_RUNNING 1
+#define EXEC_HW_NREAD (2 + EXEC_HW_NCOUNTERS)
+
+typedef enum ExecHwPhase
+{
+    EXEC_HW_PHASE_START,
+    EXEC_HW_PHASE_RUN,
+    EXEC_HW_PHASE_FINISH,
+    EXEC_HW_NPHASES
+} ExecHwPhase;
+
+typedef struct ExecHwCounters
+{
+    uint64 begin[EXEC_HW_NREAD];                       /* reading at phase start */
+    uint64 totals[EXEC_HW_NPHASES][EXEC_HW_NCOUNTERS]; /* accumulated per phase,
+                                                        * scaled */
+} ExecHwCounters;
+
+static const char *const ExecHwPhaseNames[EXEC_HW_NPHASES] = {
+    "start", "run", "finish"};
+
+static int ExecHwGroupFd = -1;
+static bool ExecHwGroupFailed = false;
+
+#ifdef __linux__
+static int
+ExecHwOpenCounter(uint64 config, int group_fd)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP |
+                       PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    if (!AcquireExternalFD())
+        return -1;
+
+    fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd,
+                      PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+    {
+        int save_errno = errno;
+
+        ReleaseExternalFD();
+        errno = save_errno;
+    }
+    return fd;
+}
+#endif
+
+/*
+ * Open the counter group, if not done already.  Returns false if counters
+ * aren't available.
+ */
+static bool
+ExecHwOpenGroup(void)
+{
+#ifdef __linux__
+    static const uint64 configs[EXEC_HW_NCOUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES};
+    int fds[EXEC_HW_NCOUNTERS];
+    int i;
+
+    if (ExecHwGroupFd >= 0)
+        return true;
+    if (ExecHwGroupFailed)
+        return false;
+
+    for (i = 0; i < EXEC_HW_NCOUNTERS; i++)
+    {
+        fds[i] = ExecHwOpenCounter(configs[i], i == 0 ? -1 : fds[0]);
+        if (fds[i] < 0)
+        {
+            ereport(WARNING,
+                    (errmsg("could not open hardware performance counters: %m"),
+                     errhint("Check the kernel.perf_event_paranoid setting.")));
+            while (--i >= 0)
+            {
+                close(fds[i]);
+                ReleaseExternalFD();
+            }
+            ExecHwGroupFailed = true;
+            return false;
+        }
+    }
+
+    /* members stay open as long as the group leader does */
+    ExecHwGroupFd = fds[0];
+    return true;
+#else
+    if (!ExecHwGroupFailed)
+        ereport(WARNING,
+                (errmsg("hardware performance counters are not supported on this platform")));
+    ExecHwGroupFailed = true;
+    return false;
+#endif
+}
+
+/*
+ * Read the group into values[EXEC_HW_NREAD]: enabled and running times,
+ * then the raw counts
+ */
+static bool
+ExecHwRead(uint64 *values)
+{
+    uint64 buf[1 + EXEC_HW_NREAD];
+
+    if (read(ExecHwGroupFd, buf, sizeof(buf)) != sizeof(buf) ||
+        buf[0] != EXEC_HW_NCOUNTERS)
+        return false;
+
+    memcpy(values, &buf[1], sizeof(uint64) * EXEC_HW_NREAD);
+    return true;
+}
+
+/*
+ * Set up counting for a new query, if wanted
  */
 static void
-CheckValidRowMarkRel(Relation rel, RowMarkType markType)
+ExecHwCountersSetup(EState *estate)
 {
-    FdwRoutine *fdwroutine;
+    if (!executor_hwcounters || !ExecHwOpenGroup())
+        return;
 
-    switch (rel->rd_rel->relkind)
+    estate->es_hwcounters = (ExecHwCounters *)
+        MemoryContextAllocZero(estate->es_query_cxt, sizeof(ExecHwCounters));
+}
+
+static void
+ExecHwCountersBegin(EState *estate)
+{
+    ExecHwCounters *hw = estate->es_hwcounters;
+
+    if (hw != NULL && !ExecHwRead(hw->begin))
+        memset(hw->begin, 0, sizeof(hw->begin));
+}
+
+static void
+ExecHwCountersEnd(EState *estate, int phase)
+{
+    ExecHwCounters *hw = estate->es_hwcounters;
+    uint64 now[EXEC_HW_NREAD];
+    uint64 enabled;
+    uint64 running;
+    int i;
+
+    if (hw == NULL || !ExecHwRead(now))
+        return;
+
+    /* a failed begin reading leaves zeroes; don't count the whole past */
+    if (hw->begin[EXEC_HW_ENABLED] == 0)
+        return;
+
+    enabled = now[EXEC_HW_ENABLED] - hw->begin[EXEC_HW_ENABLED];
+    running = now[EXEC_HW_RUNNING] - hw->begin[EXEC_HW_RUNNING];
+
+    /* the group wasn't scheduled at all during this phase */
+    if (running == 0)
+        return;
+
+    for (i = 0; i < EXEC_HW_NCOUNTERS; i++)
     {
-    case RELKIND_RELATION:
-    case RELKIND_PARTITIONED_TABLE:
-        /* OK */
-        break;
-    case RELKIND_SEQUENCE:
-        /* Must disallow this because we don't vacuum sequences */
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot lock rows in sequence \"%s\"",
-                        RelationGetRelationName(rel))));
-        break;
-    case RELKIND_TOASTVALUE:
-        /* We could allow this, but there seems no good reason to */
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot lock rows in TOAST relation \"%s\"",
-                        RelationGetRelationName(rel))));
-        break;
-    case RELKIND_VIEW:
-        /* Should not get here; planner should have expanded the view */
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot lock rows in view \"%s\"",
-                        RelationGetRelationName(rel))));
-        break;
-    case RELKIND_MATVIEW:
-        /* Allow referencing a matview, but not actual locking clauses */
-        if (markType != ROW_MARK_REFERENCE)
-            ereport(ERROR,
-                    (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                     errmsg("cannot lock rows in materialized view \"%s\"",
-                            RelationGetRelationName(rel))));
-        break;
-    case RELKIND_FOREIGN_TABLE:
-        /* Okay only if the FDW supports it */
-        fdwroutine = GetFdwRoutineForRelation(rel, false);
-        if (fdwroutine->RefetchForeignRow == NULL)
-            ereport(ERROR,
-                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                     errmsg("cannot lock rows in foreign table \"%s\"",
-                            RelationGetRelationName(rel))));
-        break;
-    default:
-        ereport(ERROR,
-                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
-                 errmsg("cannot lock rows in relation \"%s\"",
-                        RelationGetRelationName(rel))));
-        break;
+        uint64 delta = now[2 + i] - hw->begin[2 + i];
+
+        if (running < enabled)
+            delta = (uint64)((double)delta * enabled / running);
+        hw->totals[phase][i] += delta;
+    }
+}
+
+static void
+ExecHwCountersReport(EState *estate)
+{
+    ExecHwCounters *hw = estate->es_hwcounters;
+    StringInfoData buf;
+    int phase;
+
+    initStringInfo(&buf);
+    for (phase = 0; phase < EXEC_HW_NPHASES; phase++)
+    {
+        uint64 *t = hw->totals[phase];
+
+        appendStringInfo(&buf,
+                         "\n%s: cycles=" UINT64_FORMAT " instructions=" UINT64_FORMAT
+                         " ipc=%.2f cache-misses=" UINT64_FORMAT
+                         " branch-misses=" UINT64_FORMAT,
+                         ExecHwPhaseNames[phase], t[0], t[1],
+                         t[0] > 0 ? (double)t[1] / (double)t[0] : 0.0,
+                         t[2], t[3]);
+    }
+
+    ereport(LOG,
+            (errmsg("executor hardware counters:%s", buf.data)));
+    pfree(buf.data);
+}
+
+/*
+ * Timestamp counter clock for queryDesc->totaltime
+ *
+ * On many virtual machines clock_gettime() traps to the hypervisor, which
+ * makes every InstrStartNode/InstrStopNode pair on the overall runtime
+ * instrument expensive for extensions that collect it for every query.  On
+ * x86-64 CPUs with an invariant TSC, we instead read the timestamp counter
+ * directly and convert cycles to nanoseconds with a rate calibrated against
+ * CLOCK_MONOTONIC.  If the CPU doesn't advertise an invariant TSC, the
+ * kernel doesn't use the TSC as its own clocksource (it switches away from
+ * the TSC when it finds it unstable, e.g. unsynchronized across sockets or
+ * not trusted under a hypervisor), or the calibration result looks
+ * implausible, we fall back to the regular instrumentation clock for the
+ * life of the backend.
+ *
+ * Calibration doesn't wait: the first query to want the TSC notes a
+ * (TSC, CLOCK_MONOTONIC) pair, and queries keep using the regular clock
+ * until EXEC_TSC_CALIBRATION_NS has passed, when the rate is taken from the
+ * second pair.  So a short-lived backend never pays for calibrating.
+ *
+ * enable_tsc_timing is PGC_SUSET and off by default, since whether the TSC
+ * is trustworthy is a property of the machine, not of a session.
+ *
+ * The TSC clock only replaces the timer of instruments that don't also
+ * track buffer or WAL usage, since those have to go through InstrStartNode
+ * and InstrStopNode anyway.
+ */
+#if defined(__x86_64__) && defined(HAVE_CLOCK_GETTIME)
+#define EXEC_HAVE_TSC 1
+#endif
+
+#define EXEC_TSC_CALIBRATION_NS 100000000 /* calibrate over this long */
+
+#define EXEC_TSC_CLOCKSOURCE \
+    "/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+typedef enum ExecTscStatus
+{
+    EXEC_TSC_UNKNOWN,
+    EXEC_TSC_CALIBRATING,
+    EXEC_TSC_USABLE,
+    EXEC_TSC_UNUSABLE
+} ExecTscStatus;
+
+static ExecTscStatus ExecTscState = EXEC_TSC_UNKNOWN;
+static double ExecTscNsPerCycle = 0.0;
+static struct timespec ExecTscCalibrationStart;
+static uint64 ExecTscCalibrationCycles;
+
+#ifdef EXEC_HAVE_TSC
+static inline uint64
+ExecReadTsc(void)
+{
+    return __rdtsc();
+}
+
+/*
+ * Decide whether the TSC can be used, and if so start calibrating it
+ */
+static void
+ExecCheckTsc(void)
+{
+    unsigned int eax,
+        ebx,
+        ecx,
+        edx;
+    FILE *file;
+    char clocksource[32];
+    bool is_tsc;
+
+    ExecTscState = EXEC_TSC_UNUSABLE;
+
+    /* CPUID leaf 0x80000007, EDX bit 8: invariant TSC */
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 ||
+        eax < 0x80000007)
+        return;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    if ((edx & (1 << 8)) == 0)
+        return;
+
+    /* trust the TSC only as far as the kernel does */
+    file = AllocateFile(EXEC_TSC_CLOCKSOURCE, "r");
+    if (file == NULL)
+        return;
+    is_tsc = fgets(clocksource, sizeof(clocksource), file) != NULL &&
+             strcmp(clocksource, "tsc\n") == 0;
+    FreeFile(file);
+    if (!is_tsc)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ExecTscCalibrationStart);
+    ExecTscCalibrationCycles = ExecReadTsc();
+    ExecTscState = EXEC_TSC_CALIBRATING;
+}
+
+/*
+ * Finish calibrating the TSC, if it has been long enough since ExecCheckTsc
+ */
+static void
+ExecCalibrateTsc(void)
+{
+    struct timespec now;
+    uint64 cycles;
+    int64 ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    cycles = ExecReadTsc() - ExecTscCalibrationCycles;
+    ns = (int64)(now.tv_sec - ExecTscCalibrationStart.tv_sec) * 1000000000 +
+         (now.tv_nsec - ExecTscCalibrationStart.tv_nsec);
+    if (ns < EXEC_TSC_CALIBRATION_NS)
+        return;
+
+    /* anything outside 100 MHz .. 10 GHz means the counter is unreliable */
+    if (cycles < (uint64)ns / 10 || cycles > (uint64)ns * 10)
+    {
+        ExecTscState = EXEC_TSC_UNUSABLE;
+        return;
     }
+
+    ExecTscNsPerCycle = (double)ns / (double)cycles;
+    ExecTscState = EXEC_TSC_USABLE;
+}
+#endif /* EXEC_HAVE_TSC */
+
+/*
+ * Can the timer of this instrument be driven by the TSC?
+ */
+static bool
+ExecTotaltimeUseTsc(Instrumentation *instr)
+{
+#ifdef EXEC_HAVE_TSC
+    if (!enable_tsc_timing || !instr->need_timer ||
+        instr->need_bufusage || instr->need_walusage)
+        return false;
+
+    if (ExecTscState == EXEC_TSC_UNKNOWN)
+        ExecCheckTsc();
+    if (ExecTscState == EXEC_TSC_CALIBRATING)
+        ExecCalibrateTsc();
+
+    return ExecTscState == EXEC_TSC_USABLE;
+#else
+    return false;
+#endif
 }
 
 /*
- * Initialize ResultRelInfo data for one result relation
- *
- * Caution: before Postgres 9.1, this function included the relkind checking
- * that's now in CheckValidResultRel, and it also did ExecOpenIndices if
- * appropriate.  Be sure callers cover those needs.
+ * Start the overall runtime instrument.  Returns the starting TSC reading,
+ * or 0 if the regular InstrStartNode was used.
  */
-void InitResultRelInfo(ResultRelInfo *resultRelInfo,
-                       Relation resultRelationDesc,
-                       Index resultRelationIndex,
-                       ResultRelInfo *partition_root_rri,
-                       int instrument_options)
+static uint64
+ExecTotaltimeStart(Instrumentation *instr)
 {
-    List *partition_check = NIL;
+#ifdef EXEC_HAVE_TSC
+    if (ExecTotaltimeUseTsc(instr))
+        return ExecReadTsc();
+#endif
 
-    MemSet(resultRelInfo, 0, sizeof(ResultRelInfo));
-    resultRelInfo->type = T_ResultRelInfo;
-    resultRelInfo->ri_RangeTableIndex = resultRelationIndex;
-    resultRelInfo->ri_RelationDesc = resultRelationDesc;
-    resultRelInfo->ri_NumIndices = 0;
-    resultRelInfo->ri_IndexRelationDescs = NULL;
-    resultRelInfo->ri_IndexRelationInfo = NULL;
-    /* make a copy so as not to depend on relcache info not changing... */
-    resultRelInfo->ri_TrigDesc = CopyTriggerDesc(resultRelationDesc->trigdesc);
-    if (resultRelInfo->ri_TrigDesc)
-    {
-        int n = resultRelInfo->ri_TrigDesc->numtriggers;
+    InstrStartNode(instr);
+    return 0;
+}
 
-        resultRelInfo->ri_TrigFunctions = (FmgrInfo *)
-            palloc0(n * sizeof(FmgrInfo));
-        resultRelInfo->ri_TrigWhenExprs = (ExprState **)
-            palloc0(n * sizeof(ExprState *));
-        if (instrument_options)
-            resultRelInfo->ri_TrigInstrument = InstrAlloc(n, instrument_options);
-    }
-    else
+/*
+ * Stop the overall runtime instrument.  This does what InstrStopNode does
+ * for a timer-only instrument, with the elapsed time taken from the TSC.
+ */
+static void
+ExecTotaltimeStop(Instrumentation *instr, uint64 startcycles, double nTuples)
+{
+#ifdef EXEC_HAVE_TSC
+    if (startcycles != 0)
     {
-        resultRelInfo->ri_TrigFunctions = NULL;
-        resultRelInfo->ri_TrigWhenExprs = NULL;
-        resultRelInfo->ri_TrigInstrument = NULL;
-    }
-    if (resultRelationDesc->rd_rel->relkind == RELKIND_FOREIGN_TABLE)
-        resultRelInfo->ri_FdwRoutine = GetFdwRoutineForRelation(resultRelationDesc, true);
-    else
-        resultRelInfo->ri_FdwRoutine = NULL;
+        uint64 ns;
+        instr_time elapsed;
 
-    /* The following fields are set later if needed */
-    resultRelInfo->ri_FdwState = NULL;
-    resultRelInfo->ri_usesFdwDirectModify = false;
-    resultRelInfo->ri_ConstraintExprs = NULL;
-    resultRelInfo->ri_GeneratedExprs = NULL;
-    resultRelInfo->ri_junkFilter = NULL;
-    resultRelInfo->ri_projectReturning = NULL;
-    resultRelInfo->ri_onConflictArbiterIndexes = NIL;
-    resultRelInfo->ri_onConflict = NULL;
-    resultRelInfo->ri_ReturningSlot = NULL;
-    resultRelInfo->ri_TrigOldSlot = NULL;
-    resultRelInfo->ri_TrigNewSlot = NULL;
+        ns = (uint64)((double)(ExecReadTsc() - startcycles) * ExecTscNsPerCycle);
+        elapsed.tv_sec = ns / 1000000000;
+        elapsed.tv_nsec = ns % 1000000000;
 
-    /*
-     * Partition constraint, which also includes the partition constraint of
-     * all the ancestors that are partitions.  Note that it will be checked
-     * even in the case of tuple-routing where this table is the target leaf
-     * partition, if there any BR triggers defined on the table.  Although
-     * tuple-routing implicitly preserves the partition constraint of the
-     * target partition for a given row, the BR triggers may change the row
-     * such that the constraint is no longer satisfied, which we must fail for
-     * by checking it explicitly.
-     *
-     * If this is a partitioned table, the partition constraint (if any) of a
-     * given row will be checked just before performing tuple-routing.
-     */
-    partition_check = RelationGetPartitionQual(resultRelationDesc);
+        instr->tuplecount += nTuples;
+        INSTR_TIME_ADD(instr->counter, elapsed);
 
-    resultRelInfo->ri_PartitionCheck = partition_check;
-    resultRelInfo->ri_RootResultRelInfo = partition_root_rri;
-    resultRelInfo->ri_PartitionInfo = NULL; /* may be set later */
-    resultRelInfo->ri_CopyMultiInsertBuffer = NULL;
+        /* Is this the first tuple of this cycle? */
+        if (!instr->running)
+        {
+            instr->running = true;
+            instr->firsttuple = INSTR_TIME_GET_DOUBLE(instr->counter);
+        }
+        return;
+    }
+#endif
+
+    InstrStopNode(instr, nTuples);
 }
 
 /*
- * ExecGetTriggerResultRel
- *		Get a ResultRelInfo for a trigger target relation.
+ * Sampling profiler for plan nodes
  *
- * Most of the time, triggers are fired on one of the result relations of the
- * query, and so we can just return a member of the es_result_relations array,
- * or the es_root_result_relations array (if any), or the
- * es_tuple_routing_result_relations list (if any).  (Note: in self-join
- * situations there might be multiple members with the same OID; if so it
- * doesn't matter which one we pick.)
+ * EXPLAIN ANALYZE-style instrumentation reads the clock twice per
+ * ExecProcNode call, which can double the runtime of plans with cheap
+ * per-row work.  As a lighter alternative, when executor_sample_interval is
+ * set, we route each node's ExecProcNode through ExecProcNodeSampled, which
+ * merely records which node of which EState is currently executing, and let
+ * a SIGPROF interval timer count samples per node.  The timer measures CPU
+ * time, so waiting for I/O or locks isn't attributed to anyone.
  *
- * However, it is sometimes necessary to fire triggers on other relations;
- * this happens mainly when an RI update trigger queues additional triggers
- * on other relations, which will be processed in the context of the outer
- * query.  For efficiency's sake, we want to have a ResultRelInfo for those
- * triggers too; that can avoid repeated re-opening of the relation.  (It
- * also provides a way for EXPLAIN ANALYZE to report the runtimes of such
- * triggers.)  So we make additional ResultRelInfo's as needed, and save them
- * in es_trig_target_relations.
+ * The signal handler never dereferences anything but the sample state of
+ * the query being sampled, which stays allocated until its es_query_cxt is
+ * deleted; a reset callback on that context disarms the timer first, also
+ * when the query fails.  Only one query is sampled at a time; queries
+ * started while another one is being sampled are counted as "other" time of
+ * the outer query.
+ *
+ * At ExecutorEnd, the counts are logged as folded stacks ("a;b;c count"
+ * lines), which flame graph tools accept directly.
  */
-ResultRelInfo *
-ExecGetTriggerResultRel(EState *estate, Oid relid)
+typedef struct ExecSampleState
 {
-    ResultRelInfo *rInfo;
-    int nr;
-    ListCell *l;
-    Relation rel;
-    MemoryContext oldcontext;
+    EState *estate;           /* query being sampled */
+    int nnodes;               /* 1 + highest plan_node_id */
+    int *parents;             /* parent plan_node_id of each node, or -1 */
+    volatile uint64 *counts;  /* samples per plan_node_id */
+    volatile uint64 other;    /* samples outside this query's nodes */
+    int walk_parent;          /* workspace for ExecSampleInstall */
+    MemoryContextCallback cb; /* disarms the timer if the query goes away */
+} ExecSampleState;
 
-    /* First, search through the query result relations */
-    rInfo = estate->es_result_relations;
-    nr = estate->es_num_result_relations;
-    while (nr > 0)
-    {
-        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
-            return rInfo;
-        rInfo++;
-        nr--;
-    }
-    /* Second, search through the root result relations, if any */
-    rInfo = estate->es_root_result_relations;
-    nr = estate->es_num_root_result_relations;
-    while (nr > 0)
-    {
-        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
-            return rInfo;
-        rInfo++;
-        nr--;
-    }
+#define EXEC_SAMPLE_UNVISITED (-2)
 
-    /*
-     * Third, search through the result relations that were created during
-     * tuple routing, if any.
-     */
-    foreach (l, estate->es_tuple_routing_result_relations)
+static ExecSampleState *volatile ExecActiveSample = NULL;
+static EState *volatile ExecSampleCurrentEState = NULL;
+static volatile int ExecSampleCurrentNode = -1;
+
+/*
+ * ExecProcNode replacement installed on each node of a sampled query
+ *
+ * This takes over from ExecProcNodeFirst, hence the stack depth check.
+ */
+static TupleTableSlot *
+ExecProcNodeSampled(PlanState *node)
+{
+    EState *save_estate = ExecSampleCurrentEState;
+    int save_node = ExecSampleCurrentNode;
+    TupleTableSlot *result;
+
+    check_stack_depth();
+
+    ExecSampleCurrentEState = node->state;
+    ExecSampleCurrentNode = node->plan->plan_node_id;
+
+    result = node->ExecProcNodeReal(node);
+
+    ExecSampleCurrentEState = save_estate;
+    ExecSampleCurrentNode = save_node;
+
+    return result;
+}
+
+/*
+ * SIGPROF handler: charge the sample to the currently executing node
+ */
+static void
+ExecSampleHandler(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+    ExecSampleState *ss = ExecActiveSample;
+
+    if (ss != NULL)
     {
-        rInfo = (ResultRelInfo *)lfirst(l);
-        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
-            return rInfo;
+        int id = ExecSampleCurrentNode;
+
+        if (ExecSampleCurrentEState == ss->estate &&
+            id >= 0 && id < ss->nnodes)
+            ss->counts[id]++;
+        else
+            ss->other++;
     }
 
-    /* Nope, but maybe we already made an extra ResultRelInfo for it */
-    foreach (l, estate->es_trig_target_relations)
+    errno = save_errno;
+}
+
+static void
+ExecSampleSetTimer(int interval_ms)
+{
+    struct itimerval timer;
+
+    timer.it_interval.tv_sec = interval_ms / 1000;
+    timer.it_interval.tv_usec = (interval_ms % 1000) * 1000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+        elog(WARNING, "could not set profiling timer: %m");
+}
+
+/*
+ * Arm or disarm sampling of a query around ExecutorRun or ExecutorFinish.
+ * Returns true if sampling was armed, in which case the caller must call
+ * ExecSampleDisarm when done.
+ */
+static bool
+ExecSampleArm(EState *estate)
+{
+    static bool handler_installed = false;
+
+    if (estate->es_sample == NULL || ExecActiveSample != NULL)
+        return false;
+
+    if (!handler_installed)
     {
-        rInfo = (ResultRelInfo *)lfirst(l);
-        if (RelationGetRelid(rInfo->ri_RelationDesc) == relid)
-            return rInfo;
+        pqsignal(SIGPROF, ExecSampleHandler);
+        handler_installed = true;
     }
-    /* Nope, so we need a new one */
 
-    /*
-     * Open the target relation's relcache entry.  We assume that an
-     * appropriate lock is still held by the backend from whenever the trigger
-     * event got queued, so we need take no new lock here.  Also, we need not
-     * recheck the relkind, so no need for CheckValidResultRel.
-     */
-    rel = table_open(relid, NoLock);
+    ExecActiveSample = estate->es_sample;
+    ExecSampleSetTimer(executor_sample_interval);
+    return true;
+}
 
-    /*
-     * Make the new entry in the right context.
-     */
-    oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
-    rInfo = makeNode(ResultRelInfo);
-    InitResultRelInfo(rInfo,
-                      rel,
-                      0, /* dummy rangetable index */
-                      NULL,
-                      estate->es_instrument);
-    estate->es_trig_target_relations =
-        lappend(estate->es_trig_target_relations, rInfo);
-    MemoryContextSwitchTo(oldcontext);
+static void
+ExecSampleDisarm(void)
+{
+    ExecActiveSample = NULL;
+    ExecSampleSetTimer(0);
+    ExecSampleCurrentEState = NULL;
+    ExecSampleCurrentNode = -1;
+}
 
-    /*
-     * Currently, we don't need any index information in ResultRelInfos used
-     * only for triggers, so no need to call ExecOpenIndices.
-     */
+/*
+ * Reset callback on es_query_cxt: make sure the handler stops looking at
+ * the sample state before it is freed
+ */
+static void
+ExecSampleForget(void *arg)
+{
+    if (ExecActiveSample == (ExecSampleState *)arg)
+        ExecSampleDisarm();
+}
 
-    return rInfo;
+static bool
+ExecSampleMaxNodeId(PlanState *planstate, void *context)
+{
+    int *maxid = (int *)context;
+
+    *maxid = Max(*maxid, planstate->plan->plan_node_id);
+    return planstate_tree_walker(planstate, ExecSampleMaxNodeId, context);
+}
+
+static bool
+ExecSampleInstall(PlanState *planstate, void *context)
+{
+    ExecSampleState *ss = (ExecSampleState *)context;
+    int id = planstate->plan->plan_node_id;
+    int save_parent;
+
+    /* subplans are reached both from their parents and as roots */
+    if (ss->parents[id] != EXEC_SAMPLE_UNVISITED)
+        return false;
+
+    ss->parents[id] = ss->walk_parent;
+    planstate->ExecProcNode = ExecProcNodeSampled;
+
+    save_parent = ss->walk_parent;
+    ss->walk_parent = id;
+    (void)planstate_tree_walker(planstate, ExecSampleInstall, ss);
+    ss->walk_parent = save_parent;
+
+    return false;
 }
 
 /*
- * Close any relations that have been opened by ExecGetTriggerResultRel().
+ * Set up sampling for a query whose plan state tree has been initialized
+ *
+ * Not done for instrumented queries: the instrumentation wrappers that
+ * ExecProcNodeFirst would install are what sampling replaces.  Nor for
+ * queries started inside another query's run: only one query is sampled
+ * at a time (see ExecSampleArm), and a nested one could only be armed when
+ * no outer query holds the timer, so its nodes would pay for the wrapper
+ * without ever being sampled.
  */
-void ExecCleanUpTriggerState(EState *estate)
+static void
+ExecSampleInit(EState *estate, PlanState *planstate)
 {
-    ListCell *l;
+    ExecSampleState *ss;
+    ListCell *lc;
+    int maxid = 0;
+    int i;
 
-    foreach (l, estate->es_trig_target_relations)
+    if (ExecNestLevel > 0 || ExecActiveSample != NULL)
+        return;
+
+    (void)ExecSampleMaxNodeId(planstate, &maxid);
+    foreach (lc, estate->es_subplanstates)
+        (void)ExecSampleMaxNodeId((PlanState *)lfirst(lc), &maxid);
+
+    ss = (ExecSampleState *)
+        MemoryContextAllocZero(estate->es_query_cxt, sizeof(ExecSampleState));
+    ss->estate = estate;
+    ss->nnodes = maxid + 1;
+    ss->parents = (int *)
+        MemoryContextAlloc(estate->es_query_cxt, ss->nnodes * sizeof(int));
+    ss->counts = (uint64 *)
+        MemoryContextAllocZero(estate->es_query_cxt,
+                               ss->nnodes * sizeof(uint64));
+    for (i = 0; i < ss->nnodes; i++)
+        ss->parents[i] = EXEC_SAMPLE_UNVISITED;
+
+    ss->walk_parent = -1;
+    (void)ExecSampleInstall(planstate, ss);
+    foreach (lc, estate->es_subplanstates)
+        (void)ExecSampleInstall((PlanState *)lfirst(lc), ss);
+
+    ss->cb.func = ExecSampleForget;
+    ss->cb.arg = ss;
+    MemoryContextRegisterResetCallback(estate->es_query_cxt, &ss->cb);
+
+    estate->es_sample = ss;
+}
+
+/*
+ * Log the samples of a query as folded stacks, one line per plan node:
+ * "executor;node_0;node_3 <count>".
+ */
+static void
+ExecSampleReport(EState *estate)
+{
+    ExecSampleState *ss = estate->es_sample;
+    StringInfoData buf;
+    int *path;
+    int id;
+
+    initStringInfo(&buf);
+    path = (int *)palloc(ss->nnodes * sizeof(int));
+
+    if (ss->other > 0)
+        appendStringInfo(&buf, "executor " UINT64_FORMAT "\n", ss->other);
+
+    for (id = 0; id < ss->nnodes; id++)
     {
-        ResultRelInfo *resultRelInfo = (ResultRelInfo *)lfirst(l);
+        int depth = 0;
+        int n;
 
-        /*
-         * Assert this is a "dummy" ResultRelInfo, see above.  Otherwise we
-         * might be issuing a duplicate close against a Relation opened by
-         * ExecGetRangeTableRelation.
-         */
-        Assert(resultRelInfo->ri_RangeTableIndex == 0);
+        if (ss->counts[id] == 0)
+            continue;
 
-        /*
-         * Since ExecGetTriggerResultRel doesn't call ExecOpenIndices for
-         * these rels, we needn't call ExecCloseIndices either.
-         */
-        Assert(resultRelInfo->ri_NumIndices == 0);
+        for (n = id; n >= 0 && depth < ss->nnodes; n = ss->parents[n])
+            path[depth++] = n;
 
-        table_close(resultRelInfo->ri_RelationDesc, NoLock);
+        appendStringInfoString(&buf, "executor");
+        while (depth > 0)
+            appendStringInfo(&buf, ";node_%d", path[--depth]);
+        appendStringInfo(&buf, " " UINT64_FORMAT "\n", ss->counts[id]);
     }
+
+    if (buf.len > 0)
+        ereport(LOG,
+                (errmsg("executor samples:\n%s", buf.data)));
+
+    pfree(path);
+    pfree(buf.data);
 }
 
 /* ----------------------------------------------------------------
@@ -1675,11 +3524,19 @@ ExecutePlan(EState *estate,
 {
     TupleTableSlot *slot;
     uint64 current_tuple_count;
+    JunkFilter *junkfilter;
+    bool (*receiveSlot)(TupleTableSlot *slot, DestReceiver *self);
 
     /*
      * initialize local variables
+     *
+     * The junk filter and the receiver callback can't change while we run,
+     * but the compiler can't know that across the calls in the loop below,
+     * so fetch them once rather than reloading them for every tuple.
      */
     current_tuple_count = 0;
+    junkfilter = estate->es_junkFilter;
+    receiveSlot = dest->receiveSlot;
 
     /*
      * Set the direction.
@@ -1725,8 +3582,8 @@ ExecutePlan(EState *estate,
          * (Formerly, we stored it back over the "dirty" tuple, which is WRONG
          * because that tuple slot has the wrong descriptor.)
          */
-        if (estate->es_junkFilter != NULL)
-            slot = ExecFilterJunk(estate->es_junkFilter, slot);
+        if (junkfilter != NULL)
+            slot = ExecFilterJunk(junkfilter, slot);
 
         /*
          * If we are supposed to send the tuple somewhere, do so. (In
@@ -1739,7 +3596,7 @@ ExecutePlan(EState *estate,
              * has closed and no more tuples can be sent. If that's the case,
              * end the loop.
              */
-            if (!dest->receiveSlot(slot, dest))
+            if (!receiveSlot(slot, dest))
                 break;
         }
 